@@ -1,25 +1,47 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <locale.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <wchar.h>
 
 static char const USAGE[] =
 "Usage: snake [OPTION]\n"
 "\n"
-"  -a            ai not intelligent\n"
-"  -m NAME       start playing on map\n"
+"  -a [ENGINE]   ai not intelligent\n"
+"  -b GAMES      play games on maps without terminal, print stats as json\n"
+"  -B FRAMES     measure rendering of FRAMES frames with every theme\n"
+"  -l MSEC       with -V, hold own moves back to feel network lag\n"
+"  -L FILE       resume game from FILE and save it there on exit\n"
+"  -m NAME       start playing on map or the one in file\n"
 "  -M            mouse mode\n"
+"  -n BUGS       plant at most BUGS moving foods at once\n"
+"  -P FILE       publish live game state to FILE for other programs\n"
+"  -R FILE       with -b, fail if stats fall behind baseline in FILE\n"
 "  -s SPEED      set snake speed\n"
-"  -t THEME      set display theme\n"
+"  -T            tune ai parameters on maps and print the best\n"
+"  -t THEME      set display theme or load it from file\n"
+"  -V PATH       play against whoever comes to unix socket\n"
+"  -X PATH       let spectators watch on unix socket\n"
 "  -h            display this help and exit\n"
 "\n"
 "Pass 'help' as value to get full list of available\n"
@@ -32,6 +54,103 @@ static char const USAGE[] =
 
 #define ARRAY_SIZE(x) (int)(sizeof x / sizeof *x)
 
+/*
+ * Hot path probes, compiled in with -DINSTRUMENT. PROBE(id) at the top of a
+ * function counts the call and the cycles spent until it returns, children
+ * included.
+ */
+enum probe {
+	P_MOVE_SNAKE,
+	P_MOVE_FOOD,
+	P_PLANT_FOOD,
+	P_OLD_STEER,
+	P_LONGEST,
+	P_DRAW,
+	P_COUNT,
+};
+
+#ifdef INSTRUMENT
+# if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define cycles() __rdtsc()
+# else
+static unsigned long long
+cycles(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+# endif
+
+static struct {
+	char const *name;
+	unsigned long calls;
+	unsigned long long cycles;
+	int max_depth;
+	/* By log2 of cycles. */
+	unsigned long histogram[64];
+} probes[P_COUNT] = {
+	[P_MOVE_SNAKE] = { "move_snake" },
+	[P_MOVE_FOOD] = { "move_food" },
+	[P_PLANT_FOOD] = { "plant_food" },
+	[P_OLD_STEER] = { "old_steer" },
+	[P_LONGEST] = { "longest" },
+	[P_DRAW] = { "draw" },
+};
+
+static __thread int probe_depth[P_COUNT];
+
+struct probe_scope {
+	enum probe id;
+	unsigned long long start;
+};
+
+static struct probe_scope
+enter_probe(enum probe id)
+{
+	int depth = ++probe_depth[id];
+	for (int max = __atomic_load_n(&probes[id].max_depth, __ATOMIC_RELAXED);
+	     max < depth &&
+	     !__atomic_compare_exchange_n(&probes[id].max_depth, &max, depth, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);)
+		;
+	return (struct probe_scope){ id, cycles() };
+}
+
+static void
+leave_probe(struct probe_scope const *scope)
+{
+	unsigned long long n = cycles() - scope->start;
+	--probe_depth[scope->id];
+	__atomic_fetch_add(&probes[scope->id].calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&probes[scope->id].cycles, n, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&probes[scope->id].histogram[n ? 63 - __builtin_clzll(n) : 0], 1, __ATOMIC_RELAXED);
+}
+
+static void
+dump_probes(void)
+{
+	fprintf(stderr, "# probe\tcalls\tmax_depth\tcycles/call\t[log2 cycles]=calls...\n");
+	for (int i = 0; i < P_COUNT; ++i) {
+		if (!probes[i].calls)
+			continue;
+		fprintf(stderr, "%s\t%lu\t%d\t%.0f",
+				probes[i].name, probes[i].calls, probes[i].max_depth,
+				(double)probes[i].cycles / probes[i].calls);
+		for (int k = 0; k < ARRAY_SIZE(probes[i].histogram); ++k)
+			if (probes[i].histogram[k])
+				fprintf(stderr, "\t[%d]=%lu", k, probes[i].histogram[k]);
+		fprintf(stderr, "\n");
+	}
+}
+
+# define PROBE(id) \
+	struct probe_scope probe_scope __attribute__((cleanup(leave_probe))) = enter_probe(id)
+#else
+# define PROBE(id) ((void)0)
+#endif
+
 enum {
 	W = 21,
 	H = 23,
@@ -65,9 +184,41 @@ enum type {
 	T_ALPHABET,
 };
 
+/* Everything on screen. */
+enum glyph {
+	G_DIGIT = T_ALPHABET + 26,
+	G_VBORDER = G_DIGIT + 10,
+	G_HBORDER,
+	G_CORNER,
+	G_COUNT,
+};
+
+struct world;
+
+/* Map compiled from file. */
+struct layout {
+	/* Walls, ready to be copied. */
+	char jungle[H * W];
+	short free_cells[H * W];
+	int nfree_cells;
+	/* Spawn position or -1 to choose from free cells. */
+	int spawn;
+	/* Spawn direction or -1 for random. */
+	int spawn_dir;
+	/* (1 << direction) for edges not wrapping around. */
+	int nowrap;
+	/* Zobrist hash of jungle. */
+	uint64_t occupancy;
+};
+
 struct map {
 	char name[10];
-	void (*enter)(void);
+	void (*plant)(struct world *);
+};
+
+struct ai {
+	char name[10];
+	void (*steer)(struct world *, struct timespec const *);
 };
 
 static char const ASCII_ARTS[][20] = {
@@ -101,6 +252,12 @@ static char const ASCII_ARTS[][20] = {
 	"P ", "Q ", "R ", "S ", "T ",
 	"U ", "V ", "W ", "X ", "Y ",
 	"Z ",
+	[G_DIGIT] =
+	"0 ", "1 ", "2 ", "3 ", "4 ",
+	"5 ", "6 ", "7 ", "8 ", "9 ",
+	[G_VBORDER] = "|",
+	[G_HBORDER] = "--",
+	[G_CORNER] = "",
 };
 
 static char const ASCII_BLOCK_ARTS[][20] = {
@@ -140,6 +297,12 @@ static char const ASCII_BLOCK_ARTS[][20] = {
 	"P ", "Q ", "R ", "S ", "T ",
 	"U ", "V ", "W ", "X ", "Y ",
 	"Z ",
+	[G_DIGIT] =
+	"0 ", "1 ", "2 ", "3 ", "4 ",
+	"5 ", "6 ", "7 ", "8 ", "9 ",
+	[G_VBORDER] = "|",
+	[G_HBORDER] = "--",
+	[G_CORNER] = "",
 };
 
 static char const UNICODE_ARTS[][20] = {
@@ -173,9 +336,99 @@ static char const UNICODE_ARTS[][20] = {
 	"Ｐ", "Ｑ", "Ｒ", "Ｓ", "Ｔ",
 	"Ｕ", "Ｖ", "Ｗ", "Ｘ", "Ｙ",
 	"Ｚ",
+	/* Unicode SEGMENTED DIGIT ZERO... */
+	[G_DIGIT] =
+	"🯰 ", "🯱 ", "🯲 ", "🯳 ", "🯴 ",
+	"🯵 ", "🯶 ", "🯷 ", "🯸 ", "🯹 ",
+	[G_VBORDER] = "│",
+	[G_HBORDER] = "──",
+	[G_CORNER] = "┘",
+};
+
+struct art {
+	unsigned short offset;
+	unsigned char size;
+	/* Display width in columns. */
+	unsigned char width;
+	/* Index of SGR sequence in attrs. */
+	unsigned char attr;
+	/* Text has escape sequences of its own. */
+	unsigned char raw;
+};
+
+/*
+ * Arts compiled into one place. Glyphs are stored without their
+ * surrounding SGR sequences, so renderer has to change attributes only
+ * where they actually change.
+ */
+struct theme {
+	struct art glyphs[G_COUNT];
+	struct art attrs[32];
+	int nattrs;
+	/* Snake of the other player in versus mode. */
+	int rival_attr;
+	unsigned pool_size;
+	char pool[8192];
 };
 
-static char const (*ARTS)[20] = UNICODE_ARTS;
+/* Names used in theme files. */
+static struct {
+	char name[10];
+	int first;
+	int count;
+} const THEME_KEYS[] = {
+	{ "ground", T_GROUND, 1 },
+	{ "head", T_HEAD, 4 },
+	{ "snake", T_SNAKE, 16 },
+	{ "fat", T_FAT_SNAKE, 16 },
+	{ "wall", T_WALL, 1 },
+	{ "hole", T_HOLE, 1 },
+	{ "apple", T_APPLE, 1 },
+	{ "snail", T_SNAIL, 1 },
+	{ "egg", T_EGG, 1 },
+	{ "star", T_STAR, 1 },
+	{ "ant", T_ANT, 1 },
+	{ "beetle", T_BEETLE, 1 },
+	{ "present", T_PRESENT, 1 },
+	{ "hit", T_HIT, 1 },
+	{ "alphabet", T_ALPHABET, 26 },
+	{ "digit", G_DIGIT, 10 },
+	{ "vborder", G_VBORDER, 1 },
+	{ "hborder", G_HBORDER, 1 },
+	{ "corner", G_CORNER, 1 },
+};
+
+static struct {
+	char name[12];
+	char const (*arts)[20];
+} const THEMES[] = {
+	{ "ascii", ASCII_ARTS },
+	{ "ascii-block", ASCII_BLOCK_ARTS },
+	{ "unicode", UNICODE_ARTS },
+};
+
+static struct theme theme;
+
+static char frame[1 << 16];
+static size_t frame_size;
+/* Current attribute on the terminal, -1 if unknown. */
+static int frame_attr = -1;
+/* Terminal supports synchronized output (DECSET 2026). */
+static int sync_output = -1;
+
+/*
+ * Spectators get the same bytes as the terminal. Who cannot keep up
+ * waits for the next keyframe (a full repaint).
+ */
+static struct {
+	int fd;
+	int synced;
+} spectators[16];
+static int nspectators;
+static int spectator_fd = -1;
+/* SIGCONT and SIGWINCH. */
+static int signal_fd = -1;
+static char const *spectator_path;
 
 static int const SPEED_DELAYS[] = {
 	800,
@@ -201,28 +454,74 @@ static int const COMPUTER_SPEED_DELAYS[] = {
 	2,
 };
 
-static char jungle[H * W];
-static enum direction snake_dir, next_snake_dir;
-static int snake_growth;
-static int score;
-static int speed = 7;
-static int ytail, xtail;
-static int yhead, xhead;
-static int yfood, xfood;
-static int food_timeout;
-static enum direction food_dir;
-static int mushroom_bonus;
-static int star_bonus;
+enum {
+	/* Room for moving foods. */
+	MAX_BUGS = 256,
+	/* At most this many of them are planted, unless told otherwise. */
+	BUGS_ON_BOARD = 1 + H * W / 1024,
+};
+
+/* Everything that makes up a game. Plain old data, so it can be copied around
+ * and written out as is. */
+struct world {
+	char jungle[H * W];
+	enum direction snake_dir, next_snake_dir;
+	int snake_growth;
+	int score;
+	int speed;
+	int ytail, xtail;
+	int yhead, xhead;
+	/* Moving foods, one column per attribute. Type is on the jungle. */
+	short bug_pos[MAX_BUGS];
+	short bug_timeout[MAX_BUGS];
+	char bug_dir[MAX_BUGS];
+	int nbugs;
+	/* Most moving foods planted at once. */
+	int max_bugs;
+	/* 1 + index of moving food on cell or 0. */
+	unsigned short bug_at[H * W];
+	int mushroom_bonus;
+	int star_bonus;
+	unsigned seed;
+	int playing;
+	int nowrap;
+	/* Zobrist hash of what occupies the cells, kept by plant(). */
+	uint64_t occupancy;
+
+	char stepstack[H * W];
+	int nstepstack;
+
+	/* Body positions from tail to head in a ring indexed by how many
+	 * segments were ever added. */
+	short body[H * W];
+	/* Ring index of every body cell. */
+	unsigned body_index[H * W];
+	unsigned body_tail, body_head;
+
+	int partially_damaged;
+	int jungle_damage[20];
+	int num_damages;
+	int old_score, old_timeout;
+};
+
+static char const SNAPSHOT_MAGIC[8] = "snake\0\0\1";
+
+struct snapshot {
+	char magic[sizeof SNAPSHOT_MAGIC];
+	unsigned size;
+	struct world world;
+};
+
+static struct world world = {
+	.speed = 7,
+	.max_bugs = BUGS_ON_BOARD,
+};
 static int paused;
 static int mouse;
-static int computer;
+static struct ai const *computer;
+static char const *snapshot_path;
 static struct termios saved_termios;
 
-static int partially_damaged;
-static int jungle_damage[20];
-static int num_damages;
-static int old_score, old_timeout;
-
 static enum direction
 opposite(enum direction d)
 {
@@ -241,1273 +540,4590 @@ turn_right(enum direction d)
 	return (d + 1) % 4;
 }
 
-static void
-draw_cell(int pos)
+static int
+glyph_width(char const *s, size_t n)
+{
+	mbstate_t mbs;
+	memset(&mbs, 0, sizeof mbs);
+
+	int width = 0;
+	while (n) {
+		size_t k = 1;
+		if ('\033' == *s) {
+			/* Skip CSI. */
+			if (k < n && '[' == s[k])
+				for (++k; k < n && !('@' <= s[k] && s[k] <= '~'); ++k)
+					;
+			k += k < n;
+		} else {
+			wchar_t wc;
+			k = mbrtowc(&wc, s, n, &mbs);
+			if ((size_t)-2 <= k) {
+				memset(&mbs, 0, sizeof mbs);
+				k = 1;
+				wc = L'?';
+			}
+			k += !k;
+			int cw = wcwidth(wc);
+			width += cw < 0 ? 1 : cw;
+		}
+		s += k;
+		n -= k;
+	}
+	return width;
+}
+
+static int
+find_attr(struct theme *t, char const *params, size_t n)
 {
-	fputs(ARTS[(unsigned)jungle[pos]], stdout);
+	char buf[48];
+	size_t size = snprintf(buf, sizeof buf,
+			n ? "\033[0;%.*sm" : "\033[m", (int)n, params);
+	if (sizeof buf <= size)
+		return -1;
+
+	for (int i = 0; i < t->nattrs; ++i)
+		if (size == t->attrs[i].size &&
+		    !memcmp(t->pool + t->attrs[i].offset, buf, size))
+			return i;
+
+	if (ARRAY_SIZE(t->attrs) <= t->nattrs || sizeof t->pool - t->pool_size < size)
+		return -1;
+
+	struct art *attr = &t->attrs[t->nattrs];
+	attr->offset = t->pool_size;
+	attr->size = size;
+	memcpy(t->pool + t->pool_size, buf, size);
+	t->pool_size += size;
+	return t->nattrs++;
 }
 
-static void
-fire(void)
+static int
+set_glyph(struct theme *t, int g, char const *s, size_t n)
 {
-	memset(jungle, T_GROUND, sizeof jungle);
-	snake_growth = 1;
-	mushroom_bonus = 0;
-	star_bonus = 0;
-	yfood = -1;
-	food_timeout = 0;
-	partially_damaged = 0;
+	/* Collect leading SGR parameters. */
+	char params[32];
+	size_t nparams = 0;
+	while (3 <= n && '\033' == s[0] && '[' == s[1]) {
+		size_t k = 2;
+		while (k < n && (('0' <= s[k] && s[k] <= '9') || ';' == s[k]))
+			++k;
+		if (n <= k || 'm' != s[k])
+			break;
+
+		if (2 == k || (3 == k && '0' == s[2])) {
+			/* Reset. */
+			nparams = 0;
+		} else {
+			if (sizeof params < nparams + k - 1)
+				return -1;
+			if (nparams)
+				params[nparams++] = ';';
+			memcpy(params + nparams, s + 2, k - 2);
+			nparams += k - 2;
+		}
+		s += k + 1;
+		n -= k + 1;
+	}
+	/* Trailing reset is implied. */
+	while (3 <= n && !memcmp(s + n - 3, "\033[m", 3))
+		n -= 3;
+
+	int attr = find_attr(t, params, nparams);
+	int width = glyph_width(s, n);
+	/* Keep board aligned. */
+	int pad = g < G_DIGIT && width < 2 ? 2 - width : 0;
+	if (attr < 0 || UCHAR_MAX < n + pad || sizeof t->pool - t->pool_size < n + pad)
+		return -1;
+
+	struct art *glyph = &t->glyphs[g];
+	glyph->offset = t->pool_size;
+	glyph->size = n + pad;
+	glyph->width = width + pad;
+	glyph->attr = attr;
+	glyph->raw = !!memchr(s, '\033', n);
+	memcpy(t->pool + t->pool_size, s, n);
+	memset(t->pool + t->pool_size + n, ' ', pad);
+	t->pool_size += n + pad;
+	return 0;
 }
 
 static void
-draw_jungle(void)
+compile_theme(struct theme *t, char const (*arts)[20])
+{
+	t->pool_size = 0;
+	t->nattrs = 0;
+	/* Default attribute is the first. */
+	find_attr(t, "", 0);
+	t->rival_attr = find_attr(t, "7", 1);
+	for (int g = 0; g < G_COUNT; ++g)
+		set_glyph(t, g, arts[g], strlen(arts[g]));
+}
+
+static int
+find_theme(char const *name)
+{
+	for (int i = 0; i < ARRAY_SIZE(THEMES); ++i)
+		if (!strcmp(name, THEMES[i].name))
+			return i;
+	return -1;
+}
+
+/* Parse double quoted string. */
+static char *
+parse_glyph(char *p, char *buf, size_t *n)
+{
+	*n = 0;
+	if ('"' != *p++)
+		return NULL;
+	for (; '"' != *p; ++p) {
+		if (!*p || '\n' == *p || 64 <= *n)
+			return NULL;
+		char c = *p;
+		if ('\\' == c) switch (*++p) {
+		case 'e':
+			c = '\033';
+			break;
+
+		case '0': case '1': case '2': case '3':
+			c = 0;
+			for (int i = 0; i < 3 && '0' <= *p && *p <= '7'; ++i)
+				c = c * 8 + *p++ - '0';
+			--p;
+			break;
+
+		case '\\':
+		case '"':
+			c = *p;
+			break;
+
+		default:
+			return NULL;
+		}
+		buf[(*n)++] = c;
+	}
+	return p + 1;
+}
+
+/*
+ * Theme file contains lines like:
+ *
+ *   # Comment.
+ *   base ascii
+ *   head "\e[1mV \e[m" "< " "^ " " >"
+ *
+ * Keys are listed in THEME_KEYS, each takes as many glyphs as it has.
+ */
+static int
+load_theme(struct theme *t, char const *path)
 {
-	if (partially_damaged) {
-		for (int i = 0; i < num_damages; ++i) {
-			int at = jungle_damage[i];
-			fprintf(stdout, "\033[%d;%dH", 1 + at / W, 1 + (at % W) * 2);
-			draw_cell(at);
+	FILE *stream = fopen(path, "re");
+	if (!stream) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	compile_theme(t, ASCII_ARTS);
+
+	char line[1024];
+	for (int lineno = 1; fgets(line, sizeof line, stream); ++lineno) {
+		char *p = line + strspn(line, " \t");
+		if ('#' == *p || '\n' == *p || !*p)
+			continue;
+
+		size_t keylen = strcspn(p, " \t\n");
+		char *key = p;
+		p += keylen;
+		p += strspn(p, " \t");
+		key[keylen] = '\0';
+
+		if (!strcmp(key, "base")) {
+			p[strcspn(p, " \t\n")] = '\0';
+			int i = find_theme(p);
+			if (i < 0)
+				goto fail;
+			compile_theme(t, THEMES[i].arts);
+			continue;
 		}
-	} else {
-		fputs("\033[H\033[2J", stdout);
-		for (int y = 0; y < H; ++y) {
-			for (int x = 0; x < W; ++x) {
-				draw_cell(y * W + x);
-			}
-			fputs(ARTS == UNICODE_ARTS ? "\033[m│\n" : "\033[m|\n", stdout);
+
+		int k;
+		for (k = 0; k < ARRAY_SIZE(THEME_KEYS); ++k)
+			if (!strcmp(key, THEME_KEYS[k].name))
+				break;
+		if (ARRAY_SIZE(THEME_KEYS) <= k)
+			goto fail;
+
+		for (int i = 0; i < THEME_KEYS[k].count; ++i) {
+			char buf[64];
+			size_t n;
+			if (!(p = parse_glyph(p, buf, &n)) ||
+			    set_glyph(t, THEME_KEYS[k].first + i, buf, n) < 0)
+				goto fail;
+			p += strspn(p, " \t");
 		}
-		fputs("\033[m", stdout);
-		for (int x = 0; x < W; ++x)
-			fputs(ARTS == UNICODE_ARTS ? "──" : "--", stdout);
-		fputs(ARTS == UNICODE_ARTS ? "┘\n\033[m" : "\n\033[m", stdout);
+		if ('\n' != *p && *p)
+			goto fail;
+		continue;
+
+	fail:
+		fprintf(stderr, "%s:%d: Invalid line\n", path, lineno);
+		fclose(stream);
+		return -1;
 	}
-	num_damages = 0;
+
+	fclose(stream);
+	return 0;
 }
 
+/* Send buffer to spectators either as a whole or not at all. */
 static void
-draw_number(int n, int m)
+send_spectators(char const *buf, size_t size, int synced)
 {
-	for (; m; m /= 10) {
-		int digit = n / m;
-		n %= m;
+	for (int i = 0; i < nspectators; ++i) {
+		if (synced != spectators[i].synced)
+			continue;
 
-		if (ARTS == UNICODE_ARTS)
-			/* Unicode SEGMENTED DIGIT ZERO */
-			printf("\xf0\x9f\xaf%c ", 0xb0 + digit);
-		else
-			printf("%d ", digit);
+		ssize_t n = send(spectators[i].fd, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+			spectators[i].synced = 0;
+		} else if (n < 0 || (size_t)n != size) {
+			/* Stream is broken in the middle. */
+			close(spectators[i].fd);
+			spectators[i--] = spectators[--nspectators];
+		} else {
+			spectators[i].synced = 1;
+		}
 	}
 }
 
 static void
-draw_status(void)
+flush_frame(void)
 {
-	if (old_score != score || !partially_damaged) {
-		old_score = score;
-		printf("\033[%d;%dH", 1 + H + 1, 1);
-		draw_number(old_score, 100000);
-	}
+	send_spectators(frame, frame_size, 1);
 
-	if (old_timeout != food_timeout || !partially_damaged) {
-		old_timeout = food_timeout;
-		printf("\033[%d;%dH", 1 + H + 1, 1 + (W / 2 - 1) * 2);
-		if (old_timeout)
-			draw_number(old_timeout, 10);
-		else
-			printf("    ");
+	for (size_t done = 0; done < frame_size;) {
+		ssize_t n = write(STDOUT_FILENO, frame + done, frame_size - done);
+		if (n < 0) {
+			if (EINTR == errno)
+				continue;
+			break;
+		}
+		done += n;
 	}
+	frame_size = 0;
 }
 
 static void
-draw(void)
+emit(char const *s, size_t n)
 {
-	draw_jungle();
-	draw_status();
-	partially_damaged = 1;
-	fflush(stdout);
+	if (sizeof frame - frame_size < n)
+		flush_frame();
+	memcpy(frame + frame_size, s, n);
+	frame_size += n;
 }
 
 static void
-fdraw(void)
+emit_str(char const *s)
 {
-	partially_damaged = 0;
-	draw();
+	emit(s, strlen(s));
 }
 
 static void
-move(int *y, int *x, enum direction d)
+emit_attr(int attr)
 {
-	*y += (char)((((H - 1) <<   UP * 8) | (1 <<  DOWN * 8)) >> (d * 8));
-	if (H <= *y)
-		*y -= H;
-	*x += (char)((((W - 1) << LEFT * 8) | (1 << RIGHT * 8)) >> (d * 8));
-	if (W <= *x)
-		*x -= W;
+	if (attr == frame_attr)
+		return;
+
+	char const *sgr = theme.pool + theme.attrs[attr].offset;
+	size_t size = theme.attrs[attr].size;
+	/* "\033[0;...m": Nothing to reset. */
+	if (0 == frame_attr) {
+		emit(sgr, 2);
+		sgr += 4;
+		size -= 4;
+	}
+	frame_attr = attr;
+	emit(sgr, size);
 }
 
 static void
-plant(int pos, enum type t)
+emit_glyph(int g)
 {
-	partially_damaged &= num_damages < ARRAY_SIZE(jungle_damage);
-	if (partially_damaged)
-		jungle_damage[num_damages++] = pos;
-	jungle[pos] = t;
+	struct art const *glyph = &theme.glyphs[g];
+	emit_attr(glyph->attr);
+	emit(theme.pool + glyph->offset, glyph->size);
+	if (glyph->raw)
+		frame_attr = -1;
 }
 
 static void
-plant_yx(int y, int x, enum type t)
+emit_goto(int y, int x)
 {
-	plant(y * W + x, t);
+	char buf[24];
+	emit(buf, sprintf(buf, "\033[%d;%dH", y, x));
 }
 
+/* Cells of the other player's snake. */
+static uint64_t rival_at[(H * W + 63) / 64];
+
 static void
-plant_yxh(int y, int x, int n, enum type t)
+draw_cell(struct world *w, int pos)
 {
-	for (int i = 0; i < n; ++i)
-		plant_yx(y, x + i, t);
+	int g = (unsigned char)w->jungle[pos];
+	if (!(rival_at[pos / 64] >> pos % 64 & 1)) {
+		emit_glyph(g);
+		return;
+	}
+
+	/* Same glyph, in reverse. */
+	struct art const *glyph = &theme.glyphs[g];
+	emit_attr(theme.rival_attr);
+	emit(theme.pool + glyph->offset, glyph->size);
+	if (glyph->raw)
+		frame_attr = -1;
 }
 
 static void
-plant_yxv(int y, int x, int n, enum type t)
+fire(struct world *w)
 {
-	for (int i = 0; i < n; ++i)
-		plant_yx(y + i, x, t);
+	memset(w->jungle, T_GROUND, sizeof w->jungle);
+	w->occupancy = 0;
+	w->snake_growth = 1;
+	w->mushroom_bonus = 0;
+	w->star_bonus = 0;
+	w->nbugs = 0;
+	memset(w->bug_at, 0, sizeof w->bug_at);
+	w->nowrap = 0;
+	w->partially_damaged = 0;
 }
 
-static int
-plant_random(enum type t)
+/* Jungle as last drawn on terminal, if known. */
+static char shown[H * W];
+static int shown_valid;
+
+/* Draw cells set in at as the other player's from now on. */
+static void
+set_rival_at(uint64_t const *at)
 {
-	int n = 0;
+	/* Cell may change owner without changing what is on it. */
 	for (int pos = 0; pos < H * W; ++pos)
-		/* Tmp hack alphabet. */
-		n += T_GROUND == jungle[pos] || T_ALPHABET <= jungle[pos];
-	if (!n)
-		return -1;
-	n = rand() % n;
+		if ((at[pos / 64] ^ rival_at[pos / 64]) >> pos % 64 & 1)
+			shown[pos] = -1;
+	memcpy(rival_at, at, sizeof rival_at);
+}
 
-	for (int pos = 0;; ++pos) {
-		if ((T_GROUND == jungle[pos] || T_ALPHABET <= jungle[pos]) && !n--) {
-			plant(pos, t);
-			return pos;
-		}
-	}
+/* Set bit i of changed where a[i] and b[i] differ. */
+static void
+diff_cells_scalar(uint64_t *changed, char const *a, char const *b, int from, int n)
+{
+	for (int i = from; i < n; ++i)
+		changed[i / 64] |= (uint64_t)(a[i] != b[i]) << i % 64;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
 
+__attribute__((target("sse2")))
+static void
+diff_cells_sse2(uint64_t *changed, char const *a, char const *b, int from, int n)
+{
+	int i;
+	for (i = from; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((__m128i const *)(a + i));
+		__m128i y = _mm_loadu_si128((__m128i const *)(b + i));
+		uint64_t mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff;
+		changed[i / 64] |= mask << i % 64;
+	}
+	diff_cells_scalar(changed, a, b, i, n);
 }
 
+__attribute__((target("avx2")))
 static void
-plant_text(int y, int x, char const *s)
+diff_cells_avx2(uint64_t *changed, char const *a, char const *b, int from, int n)
 {
-	for (; *s; ++s) {
-		enum type t = *s == ' ' ? T_GROUND : T_ALPHABET + (*s - 'A');
-		plant_yx(y, x, t);
-		move(&y, &x, RIGHT);
+	int i;
+	for (i = from; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((__m256i const *)(a + i));
+		__m256i y = _mm256_loadu_si256((__m256i const *)(b + i));
+		uint64_t mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) & 0xffffffff;
+		changed[i / 64] |= mask << i % 64;
 	}
+	/* Tail is SSE code, which stalls on dirty upper halves. */
+	_mm256_zeroupper();
+	diff_cells_sse2(changed, a, b, i, n);
 }
 
 static void
-plant_ctext(int y, char const *s)
+diff_cells(uint64_t *changed, char const *a, char const *b, int n)
+{
+	static void (*kernel)(uint64_t *, char const *, char const *, int, int);
+	if (!kernel)
+		kernel =
+			__builtin_cpu_supports("avx2") ? diff_cells_avx2 :
+			__builtin_cpu_supports("sse2") ? diff_cells_sse2 :
+			diff_cells_scalar;
+	kernel(changed, a, b, 0, n);
+}
+#else
+static void
+diff_cells(uint64_t *changed, char const *a, char const *b, int n)
 {
-	plant_text(y, (W - strlen(s)) / 2, s);
+	diff_cells_scalar(changed, a, b, 0, n);
 }
+#endif
 
 static int
-have(enum type t)
+next_changed(uint64_t const *changed, int from, int n)
 {
-	for (int i = 0; i < H * W; ++i)
-		if (t == (enum type)jungle[i])
-			return 1;
-	return 0;
+	for (int k = from / 64; k * 64 < n; ++k) {
+		uint64_t bits = changed[k];
+		if (k == from / 64)
+			bits &= ~0ULL << from % 64;
+		if (bits)
+			return k * 64 + __builtin_ctzll(bits);
+	}
+	return n;
 }
 
+/* Draw only cells that differ from what is shown, run by run. */
 static void
-plant_food(void)
+diff_jungle(struct world *w)
 {
-	int p = rand() % 1024;
-	if (p < 50 && !have(T_HOLE)) {
-		plant_random(T_HOLE);
-	} else if (p < 300 && yfood < 0) {
-		int p = rand() % 32;
-		enum type t;
-		if (p < 10)
-			t = T_SNAIL;
-		else if (p < 20)
-			t = T_BEETLE;
-		else if (p < 30)
-			t = T_ANT;
-		else
-			t = T_PRESENT;
-		int pos = plant_random(t);
-		if (pos < 0)
-			return;
-		yfood = pos / W;
-		xfood = pos % W;
-		food_dir = T_SNAIL == t
-			? (rand() % 2 ? LEFT : RIGHT)
-			: rand() % 4;
-		if (rand() % 16 < 15)
-			food_timeout = 30;
-	} else {
-		int p = rand() % 32;
-		enum type t;
-		if (p < 17)
-			t = T_EGG;
-		else if (p < 30)
-			t = T_SNAIL;
-		else
-			t = T_BEETLE;
-		plant_random(t);
+	uint64_t changed[(H * W + 63) / 64] = { 0 };
+	diff_cells(changed, shown, w->jungle, H * W);
+
+#define CHANGED(pos) (changed[(pos) / 64] >> (pos) % 64 & 1)
+	for (int pos = 0; (pos = next_changed(changed, pos, H * W)) < H * W;) {
+		int end = pos - pos % W + W;
+		emit_goto(1 + pos / W, 1 + (pos % W) * 2);
+		/* Drawing a cell is cheaper than moving cursor over it. */
+		for (; pos < end && (CHANGED(pos) || (pos + 1 < end && CHANGED(pos + 1))); ++pos)
+			draw_cell(w, pos);
 	}
+#undef CHANGED
 }
 
 static void
-plant_nfood(int n)
+paint_jungle(struct world *w)
 {
-	for (int i = 0; i < n; ++i)
-		plant_food();
+	/* Who knows what happened to the terminal. */
+	frame_attr = -1;
+	emit_attr(0);
+	emit_str("\033[H\033[2J");
+	for (int y = 0; y < H; ++y) {
+		for (int x = 0; x < W; ++x) {
+			draw_cell(w, y * W + x);
+		}
+		emit_glyph(G_VBORDER);
+		emit_str("\n");
+	}
+	for (int x = 0; x < W; ++x)
+		emit_glyph(G_HBORDER);
+	emit_glyph(G_CORNER);
+	emit_str("\n");
 }
 
 static void
-move_food(void)
+draw_jungle(struct world *w)
 {
-	if (yfood < 0)
-		return;
-
-	if (0 < food_timeout && !--food_timeout) {
-		plant_yx(yfood, xfood, T_GROUND);
-		return;
+	if (w->partially_damaged) {
+		for (int i = 0; i < w->num_damages; ++i) {
+			int at = w->jungle_damage[i];
+			emit_goto(1 + at / W, 1 + (at % W) * 2);
+			draw_cell(w, at);
+		}
+	} else if (shown_valid) {
+		/* Too much changed to track. */
+		diff_jungle(w);
+	} else {
+		paint_jungle(w);
 	}
-
-	int y = yfood, x = xfood;
-	move(&y, &x, food_dir);
-	enum type t = jungle[y * W + x];
-	if (t != T_GROUND && !(T_HEAD <= t && t < T_HEAD + 4))
-		food_dir = opposite(food_dir);
-
-	y = yfood, x = xfood;
-	move(&y, &x, food_dir);
-	if (T_GROUND != jungle[y * W + x])
-		return;
-	t = jungle[yfood * W + xfood];
-	plant_yx(yfood, xfood, T_GROUND);
-	plant_yx((yfood = y), (xfood = x), t);
+	memcpy(shown, w->jungle, sizeof shown);
+	shown_valid = 1;
+	w->num_damages = 0;
 }
 
+/* Time left until the first moving food goes away. */
 static int
-any_special_food(void)
+bugs_timeout(struct world const *w)
 {
-	for (int i = 0; i < H * W; ++i)
-		if (T_FIRST_SFOOD <= jungle[i] && jungle[i] <= T_LAST_SFOOD)
-			return 1;
-	return 0;
+	int timeout = 0;
+	for (int k = 0; k < w->nbugs; ++k)
+		if (w->bug_timeout[k] && (!timeout || w->bug_timeout[k] < timeout))
+			timeout = w->bug_timeout[k];
+	return timeout;
 }
 
-static int
-move_snake(void)
+static void
+draw_number(int n, int m)
 {
-	if (next_snake_dir != opposite(snake_dir))
-		snake_dir = next_snake_dir;
-	next_snake_dir = snake_dir;
-
-	if (snake_growth <= 0) {
-		if (snake_growth < 0)
-			++snake_growth;
-
-		enum type t = jungle[ytail * W + xtail];
-		enum direction tail_dir = t < T_SNAKE ? snake_dir : (t - T_SNAKE) % 4;
-		/* if (!(ytail == yhead && xtail == xhead)) */
-			plant_yx(ytail, xtail, T_GROUND);
-		move(&ytail, &xtail, tail_dir);
+	for (; m; m /= 10) {
+		int digit = n / m;
+		n %= m;
 
-		/* if (ytail == yhead && xtail == xhead)
-			snake_growth = 0; */
+		emit_glyph(G_DIGIT + digit);
 	}
+}
 
+static void
+draw_status(struct world *w)
+{
+	if (w->old_score != w->score || !w->partially_damaged) {
+		w->old_score = w->score;
+		emit_goto(1 + H + 1, 1);
+		draw_number(w->old_score, 100000);
+	}
 
-	if (0 <= snake_growth) {
-		if (0 < snake_growth)
-			--snake_growth;
-
-		int prev_pos = yhead * W + xhead;
-		move(&yhead, &xhead, snake_dir);
-		int new_pos = yhead * W + xhead;
-		int bug = yhead == yfood && xhead == xfood;
-		if (bug) {
-			yfood = -1;
-			food_timeout = 0;
+	int timeout = bugs_timeout(w);
+	if (w->old_timeout != timeout || !w->partially_damaged) {
+		w->old_timeout = timeout;
+		emit_goto(1 + H + 1, 1 + (W / 2 - 1) * 2);
+		if (w->old_timeout) {
+			draw_number(w->old_timeout, 10);
+		} else {
+			/* Not in colors of whatever was drawn last. */
+			emit_attr(0);
+			emit_str("    ");
 		}
-		enum type new = jungle[new_pos];
-	again:
-		if (new == T_WALL || (T_HEAD <= new && new < T_SNAKE_END)) {
-			plant(new_pos, T_HIT);
-			return 0;
-		} else switch (new) {
-		case T_HEAD:
-		case T_SNAKE:
-		case T_FAT_SNAKE:
-		case T_WALL:
-			/* Handled above. */
-			break;
+	}
+}
 
-		case T_GROUND:
-		case T_ALPHABET:
-		default:
-			/* Ok. Move along. */
-			break;
+/* Put changes of world since last frame into frame buffer. */
+static void
+render(struct world *w)
+{
+	static char const BEGIN_SYNC[] = "\033[?2026h";
+	static char const END_SYNC[] = "\033[?2026l";
+
+	size_t start = frame_size;
+	if (0 < sync_output)
+		emit(BEGIN_SYNC, sizeof BEGIN_SYNC - 1);
+	size_t body = frame_size;
+
+	draw_jungle(w);
+	draw_status(w);
+	/* Every frame starts with default attributes. */
+	emit_attr(0);
+	w->partially_damaged = 1;
+
+	/* Let terminal present frame at once. */
+	if (0 < sync_output) {
+		if (body == frame_size)
+			frame_size = start;
+		else
+			emit(END_SYNC, sizeof END_SYNC - 1);
+	}
+}
 
-		case T_HOLE:
-			snake_growth = -9999;
-			break;
+static void
+draw(struct world *w)
+{
+	PROBE(P_DRAW);
+	render(w);
+	flush_frame();
+}
 
-		case T_APPLE:
-			snake_growth += 1;
-			score += speed;
-			if (plant_random(T_APPLE) < 0) {
-				new = T_HOLE;
-				goto again;
-			}
-
-			/* Otherwise player would not be motivated to
-			 * pick up foods immediately. */
-			if (!any_special_food())
-				plant_nfood(rand() % 4);
-			break;
+/* Next draw repaints everything on a screen of unknown state. */
+static void
+forget_screen(struct world *w)
+{
+	w->partially_damaged = 0;
+	shown_valid = 0;
+}
 
-		case T_SNAIL:
-		case T_BEETLE:
-		case T_EGG:
-		case T_ANT:
-			score += (speed + rand() % (speed * speed)) << bug;
-			snake_growth += 1;
-			break;
+static void
+fdraw(struct world *w)
+{
+	forget_screen(w);
+	draw(w);
+}
 
-		case T_PRESENT:
-			plant_nfood(2 + rand() % 4);
-			break;
+static void
+send_keyframe(struct world *w)
+{
+	int any = 0;
+	for (int i = 0; i < nspectators; ++i)
+		any |= !spectators[i].synced;
+	if (!any)
+		return;
 
-		case T_STAR:
-			star_bonus += 10;
-			break;
+	/* Frame buffer is empty here. */
+	int damaged = w->partially_damaged;
+	w->partially_damaged = 0;
+	/* Hide cursor (DECTCEM). */
+	emit_str("\033[?25l");
+	paint_jungle(w);
+	draw_status(w);
+	emit_attr(0);
+	w->partially_damaged = damaged;
+
+	send_spectators(frame, frame_size, 0);
+	frame_size = 0;
+}
 
-		case T_HIT:
-			/* Unreachable. */
-			break;
-		}
-		if (T_HOLE != new)
-			plant(new_pos, T_HEAD + snake_dir);
-		enum type old_into = T_GROUND;
-		if (new_pos != ytail * W + xtail) {
-			enum type base = snake_growth <= 0 ? T_SNAKE : T_FAT_SNAKE;
-			old_into = base + opposite(jungle[prev_pos] - T_HEAD) * 4 + snake_dir;
+static void
+accept_spectators(struct world *w)
+{
+	for (int fd; 0 <= (fd = accept4(spectator_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC));) {
+		if (ARRAY_SIZE(spectators) <= nspectators) {
+			close(fd);
+			continue;
 		}
-		plant(prev_pos, old_into);
+		spectators[nspectators].fd = fd;
+		spectators[nspectators].synced = 0;
+		++nspectators;
 	}
-	return 1;
+	send_keyframe(w);
+}
+
+static void
+remove_spectator_socket(void)
+{
+	unlink(spectator_path);
 }
 
 static int
-move_world(void)
+listen_spectators(char const *path)
 {
-	return move_snake() && (move_food(), 1);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (sizeof addr.sun_path <= strlen(path)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(ENAMETOOLONG));
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* Remove stale socket. */
+	struct stat st;
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	spectator_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (spectator_fd < 0 ||
+	    bind(spectator_fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+	    listen(spectator_fd, 8) < 0)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	spectator_path = path;
+	atexit(remove_spectator_socket);
+	return 0;
 }
 
 /*
- * Pre-pass: shortest dists from head. Exclude pos ==> x WHERE x > pos AND pos != dest
- * COUNT reachable
+ * Live game state mapped to a file for other processes (-P). Writer makes
+ * seq odd while it changes the rest; reader copies what it needs and
+ * retries while seq was odd or is different afterwards:
  *
- * @n: Distance must be at least.
+ *   do s = seq; while (s & 1 || (copy(), acquire fence, s != seq));
  */
+static char const EXPORT_MAGIC[8] = "snakeexp";
+
+struct export {
+	char magic[sizeof EXPORT_MAGIC];
+	unsigned size;
+	unsigned height, width;
+	unsigned seq;
+	/* Number of moves since the game started. */
+	unsigned tick;
+	int score;
+	int food_timeout;
+	int ytail, xtail;
+	/* -1 when snake is dead. */
+	int yhead, xhead;
+	int snake_dir;
+	/* One enum type per cell. */
+	char jungle[H * W];
+};
+
+static struct export *export;
+
 static int
-longest(int *tb, int i, int n, int dest, int rnd)
+open_export(char const *path)
 {
-	if (i == dest) {
-		if (n <= 0) {
-			/* assert(!n); */
-			goto found;
-		}
-		return 0;
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0 || ftruncate(fd, sizeof *export) < 0 ||
+	    MAP_FAILED == (export = mmap(NULL, sizeof *export, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)))
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		export = NULL;
+		if (0 <= fd)
+			close(fd);
+		return -1;
 	}
+	close(fd);
+
+	memset(export, 0, sizeof *export);
+	export->size = sizeof *export;
+	export->height = H;
+	export->width = W;
+	/* Readers may check magic last. */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(export->magic, EXPORT_MAGIC, sizeof export->magic);
+	return 0;
+}
 
-	if (0 <= tb[i])
-		return 0;
+static void
+publish_world(struct world const *w, int moved)
+{
+	struct export *e = export;
+	if (!e)
+		return;
 
-	/* dest is reachable */
-	for (int j = 0; j < H * W; ++j) {
-		if (tb[j] < 0) {
-			tb[j] = -100;
-		}
-	}
-	assert(tb[dest] != -100);
+	unsigned seq = e->seq;
+	__atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	e->tick = moved ? e->tick + 1 : 0;
+	e->score = w->score;
+	e->food_timeout = bugs_timeout(w);
+	e->ytail = w->ytail;
+	e->xtail = w->xtail;
+	e->yhead = w->yhead;
+	e->xhead = w->xhead;
+	e->snake_dir = w->snake_dir;
+	memcpy(e->jungle, w->jungle, sizeof e->jungle);
+
+	__atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
 
-#if 0
-	int nreachable = 1;
-	int reached = 0;
-	for (int changed = 1; changed;) {
-		changed = 0;
-		for (int j = 0; j < H * W; ++j) {
-			if (!(j == i || tb[j] == -1))
-				continue;
+/* Position of the i-th segment counted from the tail. */
+static int
+body_at(struct world const *w, int i)
+{
+	return w->body[(w->body_tail + i) % (H * W)];
+}
 
-			for (enum direction d = 0; d < 4; ++d) {
-				int y = j / W, x = j % W;
-				move(&y, &x, d);
-				int ii = y * W + x;
-				reached |= ii == dest;
-				if (tb[ii] == -100) {
-					tb[ii] = -1;
-					nreachable += 1;
-					changed = 1;
-				}
-				if (reached && nreachable >= n)
-					goto ok;
-			}
-		}
-	}
-#else
-	int reached = 0;
-	int nreachable = 0;
-	int stack[H * W];
-	stack[nreachable++] = i;
-	int nreached = 0;
-	while (nreached < nreachable) {
-		int j = stack[nreached++];
-		for (enum direction d = 0; d < 4; ++d) {
-			int y = j / W, x = j % W;
-			move(&y, &x, d);
-			int ii = y * W + x;
-			reached |= ii == dest;
-			if (tb[ii] == -100) {
-				tb[ii] = -1;
-				stack[nreachable++] = ii;
-			}
-		}
-		if (reached && nreachable >= n)
-			goto ok;
-	}
-#endif
+static int
+body_length(struct world const *w)
+{
+	return w->body_head - w->body_tail;
+}
 
-	return 0;
-ok:;
+/* Ticks until body cell at pos becomes free, or INT_MAX if it is not ours. */
+static int
+body_frees_in(struct world const *w, int pos)
+{
+	unsigned i = w->body_index[pos];
+	if ((unsigned)body_length(w) <= i - w->body_tail || pos != w->body[i % (H * W)])
+		return INT_MAX;
+	return i - w->body_tail + 1 +
+		(0 < w->snake_growth ? w->snake_growth : 0);
+}
 
-	if (n <= 0) {
-	found:;
-		tb[i] = INT_MAX;
-		return 1;
-	}
+static void
+push_body(struct world *w, int pos)
+{
+	w->body_index[pos] = w->body_head;
+	w->body[w->body_head++ % (H * W)] = pos;
+}
 
-	int notfood = !(T_APPLE <= jungle[i] && jungle[i] <= T_LAST_SFOOD);
+static int
+pop_body(struct world *w)
+{
+	return w->body[w->body_tail++ % (H * W)];
+}
 
-#if 0
-#define C(d0, d1, sum) int sum; do { \
-	int y = i / W, x = i % W; \
-	move(&y, &x, d0); \
-	if (0 <= d1) \
-		move(&y, &x, d1); \
-	int has = 0 <= tb[y * W + x]; \
-	sum = has; \
-} while (0) \
+static void
+move(int *y, int *x, enum direction d)
+{
+	*y += (char)((((H - 1) <<   UP * 8) | (1 <<  DOWN * 8)) >> (d * 8));
+	if (H <= *y)
+		*y -= H;
+	*x += (char)((((W - 1) << LEFT * 8) | (1 << RIGHT * 8)) >> (d * 8));
+	if (W <= *x)
+		*x -= W;
+}
 
-	C(UP, LEFT, topl);
-	C(UP, -1, top);
-	C(UP, RIGHT, topr);
+/* Stepping from pos towards d would leave through a closed edge. */
+static int
+closed_edge(struct world const *w, int pos, enum direction d)
+{
+	if (!(w->nowrap & (1 << d)))
+		return 0;
 
-	C(LEFT, -1, lef);
-	C(RIGHT, -1, rig);
+	switch (d) {
+	case UP:
+		return pos < W;
 
-	C(DOWN, LEFT, botl);
-	C(DOWN, -1, bot);
-	C(DOWN, RIGHT, botr);
+	case RIGHT:
+		return W - 1 == pos % W;
 
-	enum direction off = top + lef + rig + bot <= 1 ? rand() : topl + top + lef > top + topr + rig ? LEFT : UP; // rand();
-#endif
-	enum direction off = n <= 2 /*|| rnd */? rand() : 0;
-#if 0
-	i; /*n <= 1 ? */ rand() /* When table is almost full head follows tail. */ /*: (i, 0)*/;
-#endif
-	for (enum direction d = 0; d < 4; ++d) {
-		int y = i / W, x = i % W;
-		move(&y, &x, (d + off) % 4);
-		tb[i] = y * W + x;
-		if (longest(tb, y * W + x, n - notfood, dest, rnd))
-			return 1;
-	}
-	tb[i] = -1;
+	case DOWN:
+		return H * W - W <= pos;
 
+	case LEFT:
+		return 0 == pos % W;
+	}
 	return 0;
 }
 
-char stepstack[H * W];
-int nstepstack = 0;
+/* Cell next to pos towards d, or -1 behind a closed edge. */
+static int
+neighbor(struct world const *w, int pos, enum direction d)
+{
+	if (closed_edge(w, pos, d))
+		return -1;
+	int y = pos / W, x = pos % W;
+	move(&y, &x, d);
+	return y * W + x;
+}
 
-int latest = 0;
+/* splitmix64 finalizer. */
+static uint64_t
+mix64(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+	return x ^ (x >> 31);
+}
 
-/* NEW ALGORITHM:
- *
- * (A) Find food (bug > food > apple > tail).
- * - Compute short cycle head to tail.
- * (B) Shortest path from head->food first.
- * - Longest path: shortest path from food->everywhere, move head to more distant dir, on eq choose fewer neightbors, less (away from) (maybe?) snakes.
- * (C) Shortest path from food->(last reachable)tail. (Compute it after, since bc timeo head->food enjoys prio).
- * ! Simulate moving bug. (It can hit as hard if we do otherwise. (maybe moves between head and tail))
- * - (C) fails: Backtrack (B), retry (C). (B) maybe shortest but takes different route.
- * - fails: we are fucked.
- * - success and long enough: step on (B). (save route and next time check if every cell is empty, so we can reuse previously computed path)
- * - success but too short:
- *
- * - 
- * + Longest path from food->last.
- */
+/* Cell contents as old_steer() tells them apart. */
+enum occupant {
+	OCC_NONE,
+	OCC_HEAD,
+	OCC_SNAKE,
+	OCC_WALL,
+	OCC_HOLE,
+	OCC_APPLE,
+	OCC_SFOOD,
+	/* Taken by path being searched. */
+	OCC_PATH,
+};
 
-int stop = 0;
-/*
- * (1) Oppenent player is closer to all available cells available by us (we can get enclosed).
- *     => Go towards cell (1) farther from other player, (2) closest to us.
- *
- * (2) Find shortest path to (1) bug, (2) food, (3) apple.
- *     => Bug: simulate next 30 movements (i-th simulation == i distance far).
- *              ignore tail <-i in i-th round of simulation
- *
- *     !! BE CAREFUL WITH OTHER FOODS IN OUR WAY.
- *     .. Do not pick up food
- *     .. T.
- *     .. FH
- *     => NO: Check shortest path from our destination (bug/food/apple) to i-th
- *        tail whether we can bite it.
- *     => NO: Check longest path from our destination to i..0-th tail.
- *     => Step towards longest path form our current point to -i-th tail
- *        reachable by one of the shortest path.
- *        => REPEAT with i - 1.
- *
- * TODO: Multiplayer support (one player asdf, other uses arrows)
- */
-static void
-old_steer(void)
+static uint64_t
+zobrist(int pos, enum occupant o)
 {
-	/* TODO: Store computed next steps to improve performance. */
-	if (nstepstack) {
-		next_snake_dir = stepstack[0];
-		memmove(stepstack, stepstack + 1, --nstepstack);
-		return;
+	return OCC_NONE != o ? mix64((uint64_t)pos << 3 | o) : 0;
+}
+
+/* Key of what old_steer() searches for. Apart from every cell key, which
+ * are all below 1 << 63 before mixing, and mixing does not collide. */
+static uint64_t
+zobrist_target(int target)
+{
+	return mix64((uint64_t)1 << 63 | (unsigned)target);
+}
+
+static enum occupant
+occupant(enum type t)
+{
+	if (T_HEAD <= t && t < T_SNAKE)
+		return OCC_HEAD;
+	if (T_SNAKE <= t && t < T_SNAKE_END)
+		return OCC_SNAKE;
+	if (T_FIRST_SFOOD <= t && t <= T_LAST_SFOOD)
+		return OCC_SFOOD;
+	switch (t) {
+	case T_WALL:
+		return OCC_WALL;
+
+	case T_HOLE:
+		return OCC_HOLE;
+
+	case T_APPLE:
+		return OCC_APPLE;
+
+	default:
+		return OCC_NONE;
 	}
+}
 
-	int next[H * W];
+static uint64_t
+hash_occupancy(char const *jungle)
+{
+	uint64_t hash = 0;
 	for (int i = 0; i < H * W; ++i)
-		next[i] = -1;
+		hash ^= zobrist(i, occupant(jungle[i]));
+	return hash;
+}
 
-	int dists[H * W];
-	for (int i = 0; i < H * W; ++i)
-		dists[i] = INT_MAX;
+static void
+plant(struct world *w, int pos, enum type t)
+{
+	w->partially_damaged &= w->num_damages < ARRAY_SIZE(w->jungle_damage);
+	if (w->partially_damaged)
+		w->jungle_damage[w->num_damages++] = pos;
+	w->occupancy ^=
+		zobrist(pos, occupant(w->jungle[pos])) ^
+		zobrist(pos, occupant(t));
+	w->jungle[pos] = t;
+}
 
-	for (int i = 0; i < H * W; ++i)
-		if (T_WALL == jungle[i])
-			dists[i] = INT_MIN;
+static void
+plant_yx(struct world *w, int y, int x, enum type t)
+{
+	plant(w, y * W + x, t);
+}
 
-	/* TODO: Handle moving foods properly. */
-	/* FIXME: Fix infinite chasing of moving foods (without timeout). */
-	/* TODO: Maybe exclude apple from shortest path if there are other
-	 * foods. */
-	/* FIXME: Remove srand(), remove `snake_groth += 1`s.
-	 * -mSLIT at 988 points hits wall because snake cannot catch its tail:
-	 * the snake has length of 2 but the algorithm sees it has the length
-	 * of 15+ with its tail being completely separated (thanks to shortest
-	 * path) on the other side. To fix this when computing shortest path,
-	 * the tail of the snake have to be moved length-steps forward. */
+static void
+plant_yxh(struct world *w, int y, int x, int n, enum type t)
+{
+	for (int i = 0; i < n; ++i)
+		plant_yx(w, y, x + i, t);
+}
 
-	dists[yhead * W + xhead] = 0;
-	for (int i = yhead * W + xhead;;) {
-		for (enum direction d = 0; d < 4; ++d) {
-			int y = i / W, x = i % W;
-			move(&y, &x, d);
-			int dist = dists[i] + 1;
-			if (dists[y * W + x] <= dist)
+static void
+plant_yxv(struct world *w, int y, int x, int n, enum type t)
+{
+	for (int i = 0; i < n; ++i)
+		plant_yx(w, y + i, x, t);
+}
+
+static int
+plant_random(struct world *w, enum type t)
+{
+	int n = 0;
+	for (int pos = 0; pos < H * W; ++pos)
+		/* Tmp hack alphabet. */
+		n += T_GROUND == w->jungle[pos] || T_ALPHABET <= w->jungle[pos];
+	if (!n)
+		return -1;
+	n = rand_r(&w->seed) % n;
+
+	for (int pos = 0;; ++pos) {
+		if ((T_GROUND == w->jungle[pos] || T_ALPHABET <= w->jungle[pos]) && !n--) {
+			plant(w, pos, t);
+			return pos;
+		}
+	}
+
+}
+
+static void
+plant_text(struct world *w, int y, int x, char const *s)
+{
+	for (; *s; ++s) {
+		enum type t = *s == ' ' ? T_GROUND : T_ALPHABET + (*s - 'A');
+		plant_yx(w, y, x, t);
+		move(&y, &x, RIGHT);
+	}
+}
+
+static void
+plant_ctext(struct world *w, int y, char const *s)
+{
+	plant_text(w, y, (W - strlen(s)) / 2, s);
+}
+
+static int
+have(struct world *w, enum type t)
+{
+	for (int i = 0; i < H * W; ++i)
+		if (t == (enum type)w->jungle[i])
+			return 1;
+	return 0;
+}
+
+static void
+plant_food(struct world *w)
+{
+	PROBE(P_PLANT_FOOD);
+	int p = rand_r(&w->seed) % 1024;
+	if (p < 50 && !have(w, T_HOLE)) {
+		plant_random(w, T_HOLE);
+	} else if (p < 300 && w->nbugs < w->max_bugs) {
+		int p = rand_r(&w->seed) % 32;
+		enum type t;
+		if (p < 10)
+			t = T_SNAIL;
+		else if (p < 20)
+			t = T_BEETLE;
+		else if (p < 30)
+			t = T_ANT;
+		else
+			t = T_PRESENT;
+		int pos = plant_random(w, t);
+		if (pos < 0)
+			return;
+		int k = w->nbugs++;
+		w->bug_pos[k] = pos;
+		w->bug_at[pos] = 1 + k;
+		w->bug_dir[k] = T_SNAIL == t
+			? (rand_r(&w->seed) % 2 ? LEFT : RIGHT)
+			: rand_r(&w->seed) % 4;
+		w->bug_timeout[k] = rand_r(&w->seed) % 16 < 15 ? 30 : 0;
+	} else {
+		int p = rand_r(&w->seed) % 32;
+		enum type t;
+		if (p < 17)
+			t = T_EGG;
+		else if (p < 30)
+			t = T_SNAIL;
+		else
+			t = T_BEETLE;
+		plant_random(w, t);
+	}
+}
+
+static void
+plant_nfood(struct world *w, int n)
+{
+	for (int i = 0; i < n; ++i)
+		plant_food(w);
+}
+
+static void
+remove_bug(struct world *w, int k)
+{
+	w->bug_at[w->bug_pos[k]] = 0;
+	if (k == --w->nbugs)
+		return;
+	w->bug_pos[k] = w->bug_pos[w->nbugs];
+	w->bug_timeout[k] = w->bug_timeout[w->nbugs];
+	w->bug_dir[k] = w->bug_dir[w->nbugs];
+	w->bug_at[w->bug_pos[k]] = 1 + k;
+}
+
+static void
+move_food(struct world *w)
+{
+	PROBE(P_MOVE_FOOD);
+	/* Backwards, so removed ones are replaced by already moved ones. */
+	for (int k = w->nbugs; 0 <= --k;) {
+		int pos = w->bug_pos[k];
+		if (0 < w->bug_timeout[k] && !--w->bug_timeout[k]) {
+			plant(w, pos, T_GROUND);
+			remove_bug(w, k);
+			continue;
+		}
+
+		int y = pos / W, x = pos % W;
+		move(&y, &x, w->bug_dir[k]);
+		enum type t = w->jungle[y * W + x];
+		if ((t != T_GROUND && !(T_HEAD <= t && t < T_HEAD + 4)) ||
+		    closed_edge(w, pos, w->bug_dir[k]))
+			w->bug_dir[k] = opposite(w->bug_dir[k]);
+
+		y = pos / W, x = pos % W;
+		move(&y, &x, w->bug_dir[k]);
+		int new_pos = y * W + x;
+		if (T_GROUND != w->jungle[new_pos] ||
+		    closed_edge(w, pos, w->bug_dir[k]))
+			continue;
+		plant(w, new_pos, w->jungle[pos]);
+		plant(w, pos, T_GROUND);
+		w->bug_at[pos] = 0;
+		w->bug_at[new_pos] = 1 + k;
+		w->bug_pos[k] = new_pos;
+	}
+}
+
+static int
+any_special_food(struct world *w)
+{
+	for (int i = 0; i < H * W; ++i)
+		if (T_FIRST_SFOOD <= w->jungle[i] && w->jungle[i] <= T_LAST_SFOOD)
+			return 1;
+	return 0;
+}
+
+/* Turn and pull tail along, unless growing. */
+static void
+begin_move(struct world *w)
+{
+	if (w->next_snake_dir != opposite(w->snake_dir))
+		w->snake_dir = w->next_snake_dir;
+	w->next_snake_dir = w->snake_dir;
+
+	if (w->snake_growth <= 0) {
+		if (w->snake_growth < 0)
+			++w->snake_growth;
+
+		if (body_length(w))
+			plant(w, pop_body(w), T_GROUND);
+	}
+}
+
+/* Cell head enters after begin_move(), or -1 if it does not enter any. */
+static int
+next_head(struct world const *w)
+{
+	int pos = w->yhead * W + w->xhead;
+	if (w->snake_growth < 0 || closed_edge(w, pos, w->snake_dir))
+		return -1;
+	int y = w->yhead, x = w->xhead;
+	move(&y, &x, w->snake_dir);
+	return y * W + x;
+}
+
+/* Move head after begin_move(). Return 0 if snake dies. */
+static int
+finish_move(struct world *w)
+{
+
+	if (0 <= w->snake_growth) {
+		if (0 < w->snake_growth)
+			--w->snake_growth;
+
+		int prev_pos = w->yhead * W + w->xhead;
+		if (closed_edge(w, prev_pos, w->snake_dir)) {
+			plant(w, prev_pos, T_HIT);
+			return 0;
+		}
+		move(&w->yhead, &w->xhead, w->snake_dir);
+		int new_pos = w->yhead * W + w->xhead;
+		int bug = 0 < w->bug_at[new_pos];
+		if (bug)
+			remove_bug(w, w->bug_at[new_pos] - 1);
+		enum type new = w->jungle[new_pos];
+	again:
+		if (new == T_WALL || new == T_HIT || (T_HEAD <= new && new < T_SNAKE_END)) {
+			plant(w, new_pos, T_HIT);
+			return 0;
+		} else switch (new) {
+		case T_HEAD:
+		case T_SNAKE:
+		case T_FAT_SNAKE:
+		case T_WALL:
+		case T_HIT:
+			/* Handled above. Hit is where other snake died. */
+			break;
+
+		case T_GROUND:
+		case T_ALPHABET:
+		default:
+			/* Ok. Move along. */
+			break;
+
+		case T_HOLE:
+			w->snake_growth = -9999;
+			break;
+
+		case T_APPLE:
+			w->snake_growth += 1;
+			w->score += w->speed;
+			if (plant_random(w, T_APPLE) < 0) {
+				new = T_HOLE;
+				goto again;
+			}
+
+			/* Otherwise player would not be motivated to
+			 * pick up foods immediately. */
+			if (!any_special_food(w))
+				plant_nfood(w, rand_r(&w->seed) % 4);
+			break;
+
+		case T_SNAIL:
+		case T_BEETLE:
+		case T_EGG:
+		case T_ANT:
+			w->score += (w->speed + rand_r(&w->seed) % (w->speed * w->speed)) << bug;
+			w->snake_growth += 1;
+			break;
+
+		case T_PRESENT:
+			plant_nfood(w, 2 + rand_r(&w->seed) % 4);
+			break;
+
+		case T_STAR:
+			w->star_bonus += 10;
+			break;
+
+		}
+		if (T_HOLE != new)
+			plant(w, new_pos, T_HEAD + w->snake_dir);
+		push_body(w, new_pos);
+		enum type old_into = T_GROUND;
+		if (1 < body_length(w)) {
+			enum type base = w->snake_growth <= 0 ? T_SNAKE : T_FAT_SNAKE;
+			old_into = base + opposite(w->jungle[prev_pos] - T_HEAD) * 4 + w->snake_dir;
+		}
+		plant(w, prev_pos, old_into);
+	}
+
+	/* Nothing left of it after the hole: tail stays where head was. */
+	int tail = body_length(w) ? body_at(w, 0) : w->yhead * W + w->xhead;
+	w->ytail = tail / W;
+	w->xtail = tail % W;
+	return 1;
+}
+
+static int
+move_snake(struct world *w)
+{
+	PROBE(P_MOVE_SNAKE);
+	begin_move(w);
+	return finish_move(w);
+}
+
+static int
+move_world(struct world *w)
+{
+	return move_snake(w) && (move_food(w), 1);
+}
+
+/* Knobs of old_steer(). */
+struct ai_params {
+	/* Go for special foods before apple. */
+	int special_first;
+	/* Holes count as special foods. */
+	int holes;
+	/* longest() tries directions in random order this close to the end. */
+	int random_below;
+	/* Try every n-th segment of the snake as tail. */
+	int tail_stride;
+	/* longest() steps first where fewest ways go on. */
+	int warnsdorff;
+};
+
+static struct ai_params const DEFAULT_AI_PARAMS = {
+	.special_first = 1,
+	.holes = 1,
+	.random_below = 2,
+	.tail_stride = 1,
+	/* Helps on SLIT only. Over -b 20 it scores lower on every other map
+	 * and 1.4% lower in total. */
+	.warnsdorff = 0,
+};
+
+/* Scratch space of old_steer(), reused by every search frame. */
+struct workspace {
+	short next[H * W];
+	short dists[H * W];
+	short max[H * W];
+	short stack[H * W];
+	/* Cell is visited by the current flood if stamped with generation. */
+	unsigned short seen[H * W];
+	unsigned short generation;
+	/* Room pass of longest(), searched from dest. */
+	short disc[H * W], low[H * W];
+	/* Cells a path may pass through in search subtree, and those of them
+	 * cut off from dest when the cell is taken, by color. */
+	short subtree[2][H * W], cut[2][H * W];
+	char passable[H * W];
+	/* Next direction to look at and free neighbors seen so far. */
+	unsigned char dir[H * W], degree[H * W];
+	int ndisc;
+	int parity;
+};
+
+enum {
+	TRANSPOSITIONS = 1 << 15,
+};
+
+/*
+ * longest() calls known to fail, by Zobrist hash of the world, the cells
+ * taken so far, the cell it is at, the length still needed and the
+ * destination. Newer one wins a slot.
+ */
+struct transpositions {
+	uint64_t failed[TRANSPOSITIONS];
+};
+
+struct planner {
+	struct ai_params const *params;
+	struct workspace ws;
+	/* May be NULL. */
+	struct transpositions *tt;
+	struct timespec deadline;
+	int timed_out;
+	unsigned nodes;
+	/* Planner draws from its own, so moves it tries leave the game's
+	 * rolls alone. */
+	unsigned seed;
+};
+
+static int
+expired(struct timespec const *deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return
+		deadline->tv_sec < now.tv_sec ||
+		(deadline->tv_sec == now.tv_sec &&
+		 deadline->tv_nsec <= now.tv_nsec);
+}
+
+static int
+steer_expired(struct planner *pl)
+{
+	if (!pl->timed_out)
+		pl->timed_out = expired(&pl->deadline);
+	return pl->timed_out;
+}
+
+/* Checkerboard color of cell. */
+static int
+color(int pos)
+{
+	return (pos / W + pos % W) & 1;
+}
+
+/* Step between neighbors wraps around an edge of odd length. */
+static int
+crosses_odd_edge(int dy, int dx)
+{
+	return
+		((H & 1) && (1 < dy || dy < -1)) ||
+		((W & 1) && (1 < dx || dx < -1));
+}
+
+/*
+ * Most cells a path from color @from can have before stepping on color @to,
+ * given number of cells it may use of either color. Without @parity colors
+ * need not alternate.
+ */
+static int
+path_bound(int const ncolor[2], int from, int to, int parity)
+{
+	int same = ncolor[from], other = ncolor[!from];
+	if (!parity)
+		return same + other;
+	/* Last one is the other color if it ends next to same color. */
+	if (from == to)
+		return 2 * (same < other ? same : other);
+	return 2 * (same - 1 < other ? same - 1 : other) + 1;
+}
+
+/* Free cells next to pos, not counting from. */
+static int
+open_neighbors(struct world const *w, short const *tb, int pos, int from, int dest)
+{
+	int n = 0;
+	for (enum direction d = 0; d < 4; ++d) {
+		int j = neighbor(w, pos, d);
+		n += 0 <= j && j != from && (tb[j] < 0 || j == dest);
+	}
+	return n;
+}
+
+static void
+next_generation(struct workspace *ws)
+{
+	if (!++ws->generation) {
+		memset(ws->seen, 0, sizeof ws->seen);
+		ws->generation = 1;
+	}
+}
+
+/* Most cells a path may use by color, and whether colors alternate. */
+struct room {
+	int ncolor[2];
+	int parity;
+};
+
+static void
+enter_room(struct workspace *ws, int i)
+{
+	ws->seen[i] = ws->generation;
+	ws->disc[i] = ws->low[i] = ws->ndisc++;
+	ws->dir[i] = 0;
+	ws->degree[i] = 0;
+	for (int c = 0; c < 2; ++c)
+		ws->subtree[c][i] = ws->cut[c][i] = 0;
+}
+
+/*
+ * Search tb from dest, the way longest() would flood it from the other end.
+ * Tarjan's algorithm finds in the same pass what taking a cell cuts off.
+ */
+static void
+find_room(struct workspace *ws, struct world const *w, short const *tb, int dest)
+{
+	next_generation(ws);
+	ws->ndisc = 0;
+	ws->parity = 1;
+
+	short *stack = ws->stack;
+	int nstack = 0;
+	enter_room(ws, dest);
+	stack[nstack++] = dest;
+	while (nstack) {
+		int i = stack[nstack - 1];
+		if (ws->dir[i] < 4) {
+			int j = neighbor(w, i, ws->dir[i]++);
+			if (j < 0 || !(tb[j] < 0 || j == dest))
 				continue;
+			++ws->degree[i];
+			ws->parity &= !crosses_odd_edge(j / W - i / W, j % W - i % W);
+
+			if (ws->generation != ws->seen[j]) {
+				enter_room(ws, j);
+				stack[nstack++] = j;
+			} else if (ws->disc[j] < ws->low[i]) {
+				ws->low[i] = ws->disc[j];
+			}
+			continue;
+		}
+
+		/* Path cannot pass through a dead end. */
+		ws->passable[i] = i != dest && 2 <= ws->degree[i];
+		ws->subtree[color(i)][i] += ws->passable[i];
+
+		if (!--nstack)
+			break;
+		int p = stack[nstack - 1];
+		if (ws->low[i] < ws->low[p])
+			ws->low[p] = ws->low[i];
+		/* i cannot get around p to dest. */
+		int alone = ws->disc[p] <= ws->low[i];
+		for (int c = 0; c < 2; ++c) {
+			ws->subtree[c][p] += ws->subtree[c][i];
+			ws->cut[c][p] += alone ? ws->subtree[c][i] : 0;
+		}
+	}
+}
+
+/*
+ * Room of path from free cell i after find_room(). Only what taking i
+ * leaves on the side of dest counts, unlike a flood from i. Return 0 if
+ * dest cannot be reached.
+ */
+static int
+room_from(struct workspace const *ws, int i, int dest, struct room *room)
+{
+	if (ws->generation != ws->seen[i])
+		return 0;
+	for (int c = 0; c < 2; ++c)
+		room->ncolor[c] = ws->subtree[c][dest] - ws->cut[c][i];
+	/* Start counts even if dead end. */
+	room->ncolor[color(i)] += !ws->passable[i];
+	room->parity = ws->parity;
+	return 1;
+}
+
+/*
+ * Whether taking free cell i may split free cells next to it: going round
+ * its eight neighbors they do not make a single run. If they do, the run
+ * keeps them connected without i.
+ */
+static int
+may_cut(struct world const *w, short const *tb, int i, int dest)
+{
+	int free[8];
+	for (int k = 0; k < 8; ++k) {
+		/* Even k straight, odd k diagonal: side then next side. */
+		int j = neighbor(w, i, k / 2);
+		if (k & 1 && 0 <= j)
+			j = neighbor(w, j, (k / 2 + 1) % 4);
+		free[k] = 0 <= j && (tb[j] < 0 || j == dest);
+	}
+	int nruns = 0;
+	for (int k = 0; k < 8; ++k)
+		nruns += free[k] && !free[(k + 7) % 8];
+	return 1 < nruns;
+}
+
+/*
+ * Pre-pass: shortest dists from head. Exclude pos ==> x WHERE x > pos AND pos != dest
+ * COUNT reachable
+ *
+ * @n: Distance must be at least.
+ */
+static int
+longest(struct planner *pl, struct world *w, short *tb, int i, int n, int dest, int rnd, uint64_t taken,
+		struct room const *room)
+{
+	PROBE(P_LONGEST);
+	/* Checking clock is not free. */
+	if (pl->timed_out || (!(++pl->nodes % 16) && steer_expired(pl)))
+		return 0;
+
+	if (i == dest) {
+		if (n <= 0) {
+			/* assert(!n); */
+			goto found;
+		}
+		return 0;
+	}
+
+	if (0 <= tb[i])
+		return 0;
+
+	uint64_t key = taken ^ mix64((uint64_t)i << 40 ^ (uint64_t)(unsigned)n << 20 ^ dest);
+	uint64_t *slot = pl->tt ? &pl->tt->failed[key % TRANSPOSITIONS] : NULL;
+	if (slot && key == *slot)
+		return 0;
+
+	/* dest is reachable */
+	struct workspace *ws = &pl->ws;
+	/* Caller has checked room. */
+	if (room)
+		goto ok;
+	next_generation(ws);
+
+#if 0
+	int nreachable = 1;
+	int reached = 0;
+	for (int changed = 1; changed;) {
+		changed = 0;
+		for (int j = 0; j < H * W; ++j) {
+			if (!(j == i || tb[j] == -1))
+				continue;
+
+			for (enum direction d = 0; d < 4; ++d) {
+				int y = j / W, x = j % W;
+				move(&y, &x, d);
+				int ii = y * W + x;
+				reached |= ii == dest;
+				if (tb[ii] == -100) {
+					tb[ii] = -1;
+					nreachable += 1;
+					changed = 1;
+				}
+				if (reached && nreachable >= n)
+					goto ok;
+			}
+		}
+	}
+#else
+	int reached = 0;
+	int nreachable = 0;
+	/* Cells path may pass through, by checkerboard color. */
+	int ncolor[2] = { 0, 0 };
+	/* Path alternates colors unless it wraps around an odd edge. */
+	int parity = 1;
+	int from = color(i), to = color(dest);
+	short *stack = ws->stack;
+	stack[nreachable++] = i;
+	int nreached = 0;
+	while (nreached < nreachable) {
+		int j = stack[nreached++];
+		int jy = j / W, jx = j % W;
+		int degree = 0;
+		for (enum direction d = 0; d < 4; ++d) {
+			int ii = neighbor(w, j, d);
+			if (ii < 0)
+				continue;
+			reached |= ii == dest;
+			if (tb[ii] < 0 || ii == dest) {
+				++degree;
+				parity &= !crosses_odd_edge(ii / W - jy, ii % W - jx);
+			}
+			if (tb[ii] < 0 && ws->generation != ws->seen[ii]) {
+				ws->seen[ii] = ws->generation;
+				stack[nreachable++] = ii;
+			}
+		}
+		/* Path cannot pass through a dead end. */
+		if (j == i || 2 <= degree)
+			++ncolor[(jy + jx) & 1];
+		if (reached && n <= path_bound(ncolor, from, to, parity))
+			goto ok;
+	}
+#endif
+
+	if (slot)
+		*slot = key;
+	return 0;
+ok:;
+
+	if (n <= 0) {
+	found:;
+		tb[i] = SHRT_MAX;
+		return 1;
+	}
+
+	int notfood = !(T_APPLE <= w->jungle[i] && w->jungle[i] <= T_LAST_SFOOD);
+
+#if 0
+#define C(d0, d1, sum) int sum; do { \
+	int y = i / W, x = i % W; \
+	move(&y, &x, d0); \
+	if (0 <= d1) \
+		move(&y, &x, d1); \
+	int has = 0 <= tb[y * W + x]; \
+	sum = has; \
+} while (0) \
+
+	C(UP, LEFT, topl);
+	C(UP, -1, top);
+	C(UP, RIGHT, topr);
+
+	C(LEFT, -1, lef);
+	C(RIGHT, -1, rig);
+
+	C(DOWN, LEFT, botl);
+	C(DOWN, -1, bot);
+	C(DOWN, RIGHT, botr);
+
+	enum direction off = top + lef + rig + bot <= 1 ? rand() : topl + top + lef > top + topr + rig ? LEFT : UP; // rand();
+#endif
+	enum direction off = n <= pl->params->random_below /*|| rnd */? rand_r(&pl->seed) : 0;
+#if 0
+	i; /*n <= 1 ? */ rand() /* When table is almost full head follows tail. */ /*: (i, 0)*/;
+#endif
+	/*
+	 * Unless taking i may cut something off, neighbors have the room of i
+	 * without it. Otherwise one pass over the table tells room of every
+	 * neighbor.
+	 */
+	int cuts = !room || may_cut(w, tb, i, dest);
+	tb[i] = SHRT_MAX;
+	if (cuts)
+		find_room(ws, w, tb, dest);
+
+	/* Neighbor with fewest ways on first, ties in old order. */
+	int order[4], ways[4], fits[4];
+	struct room rooms[4];
+	for (int k = 0; k < 4; ++k) {
+		int j = neighbor(w, i, (k + off) % 4);
+		struct room *r = &rooms[k];
+		if (j < 0) {
+			fits[k] = 0;
+		} else if (j == dest || 0 <= tb[j]) {
+			fits[k] = j == dest;
+		} else if (cuts) {
+			fits[k] = room_from(ws, j, dest, r);
+		} else {
+			*r = *room;
+			--r->ncolor[color(i)];
+			/* Start counts even if dead end. */
+			r->ncolor[color(j)] += open_neighbors(w, tb, j, i, dest) < 2;
+			fits[k] = 1;
+		}
+		fits[k] = fits[k] && (j == dest ||
+				n - notfood <= path_bound(r->ncolor, color(j), color(dest), r->parity));
+		ways[k] =
+			!pl->params->warnsdorff ? 0 :
+			j < 0 ? 4 :
+			j == dest ? -1 :
+			0 <= tb[j] ? 4 :
+			open_neighbors(w, tb, j, i, dest);
+		int m = k;
+		for (; 0 < m && ways[k] < ways[order[m - 1]]; --m)
+			order[m] = order[m - 1];
+		order[m] = k;
+	}
+
+	for (int k = 0; k < 4; ++k) {
+		if (!fits[order[k]])
+			continue;
+		int j = neighbor(w, i, (order[k] + off) % 4);
+		tb[i] = j;
+		if (longest(pl, w, tb, j, n - notfood, dest, rnd, taken ^ zobrist(i, OCC_PATH), &rooms[order[k]]))
+			return 1;
+	}
+	tb[i] = -1;
+
+	/* Ran out of time, not of paths. */
+	if (slot && !pl->timed_out)
+		*slot = key;
+	return 0;
+}
+
+/* NEW ALGORITHM:
+ *
+ * (A) Find food (bug > food > apple > tail).
+ * - Compute short cycle head to tail.
+ * (B) Shortest path from head->food first.
+ * - Longest path: shortest path from food->everywhere, move head to more distant dir, on eq choose fewer neightbors, less (away from) (maybe?) snakes.
+ * (C) Shortest path from food->(last reachable)tail. (Compute it after, since bc timeo head->food enjoys prio).
+ * ! Simulate moving bug. (It can hit as hard if we do otherwise. (maybe moves between head and tail))
+ * - (C) fails: Backtrack (B), retry (C). (B) maybe shortest but takes different route.
+ * - fails: we are fucked.
+ * - success and long enough: step on (B). (save route and next time check if every cell is empty, so we can reuse previously computed path)
+ * - success but too short:
+ *
+ * - 
+ * + Longest path from food->last.
+ */
+
+int stop = 0;
+/*
+ * (1) Oppenent player is closer to all available cells available by us (we can get enclosed).
+ *     => Go towards cell (1) farther from other player, (2) closest to us.
+ *
+ * (2) Find shortest path to (1) bug, (2) food, (3) apple.
+ *     => Bug: simulate next 30 movements (i-th simulation == i distance far).
+ *              ignore tail <-i in i-th round of simulation
+ *
+ *     !! BE CAREFUL WITH OTHER FOODS IN OUR WAY.
+ *     .. Do not pick up food
+ *     .. T.
+ *     .. FH
+ *     => NO: Check shortest path from our destination (bug/food/apple) to i-th
+ *        tail whether we can bite it.
+ *     => NO: Check longest path from our destination to i..0-th tail.
+ *     => Step towards longest path form our current point to -i-th tail
+ *        reachable by one of the shortest path.
+ *        => REPEAT with i - 1.
+ *
+ * TODO: Multiplayer support (one player asdf, other uses arrows)
+ */
+static int
+old_steer(struct planner *pl, struct world *w)
+{
+	PROBE(P_OLD_STEER);
+	/* TODO: Store computed next steps to improve performance. */
+	if (w->nstepstack) {
+		w->next_snake_dir = w->stepstack[0];
+		memmove(w->stepstack, w->stepstack + 1, --w->nstepstack);
+		return 1;
+	}
+
+	short *next = pl->ws.next;
+	for (int i = 0; i < H * W; ++i)
+		next[i] = -1;
+
+	short *dists = pl->ws.dists;
+	for (int i = 0; i < H * W; ++i)
+		dists[i] = SHRT_MAX;
+
+	for (int i = 0; i < H * W; ++i)
+		if (T_WALL == w->jungle[i])
+			dists[i] = SHRT_MIN;
+
+	/* TODO: Handle moving foods properly. */
+	/* FIXME: Fix infinite chasing of moving foods (without timeout). */
+	/* TODO: Maybe exclude apple from shortest path if there are other
+	 * foods. */
+	/* FIXME: Remove srand(), remove `snake_groth += 1`s.
+	 * -mSLIT at 988 points hits wall because snake cannot catch its tail:
+	 * the snake has length of 2 but the algorithm sees it has the length
+	 * of 15+ with its tail being completely separated (thanks to shortest
+	 * path) on the other side. To fix this when computing shortest path,
+	 * the tail of the snake have to be moved length-steps forward. */
+
+	dists[w->yhead * W + w->xhead] = 0;
+	for (int i = w->yhead * W + w->xhead;;) {
+		for (enum direction d = 0; d < 4; ++d) {
+			int j = neighbor(w, i, d);
+			int dist = dists[i] + 1;
+			if (j < 0 || dists[j] <= dist)
+				continue;
+
+			if (!(T_SNAKE <= w->jungle[j] && w->jungle[j] < T_SNAKE_END)) {
+				if (next[j] < 0) {
+					next[j] = next[i];
+					next[i] = j;
+				}
+			}
+
+			dists[j] = dist;
+		}
+
+		int oldi = i;
+		i = next[i];
+		next[oldi] = -1;
+		if (i < 0)
+			break;
+	}
+
+
+	int anyfood = 0;
+	int api = -1;
+	int speci = -1;
+	for (int i = 0; i < H * W; ++i) {
+		anyfood |= T_APPLE == w->jungle[i];
+		if (dists[i] == SHRT_MAX)
+			continue;
+		if (T_APPLE == w->jungle[i]) {
+			api = i;
+		} else if (((T_FIRST_SFOOD <= w->jungle[i] && w->jungle[i] <= T_LAST_SFOOD) || (pl->params->holes && w->jungle[i] == T_HOLE)) && (speci < 0 || dists[i] < dists[speci])) {
+			speci = i;
+		}
+	}
+	if (!anyfood)
+		return 0;
+	int target = pl->params->special_first ? speci : api;
+	if (target < 0)
+		target = pl->params->special_first ? api : speci;
+
+retarget:;
+
+	short *max = pl->ws.max;
+
+	enum direction oldd = w->snake_dir;
+	int ok = 0;
+	int seg = 0;
+	int tail = body_at(w, seg);
+	int nthtail = 1 + w->snake_growth;
+	for (;;) {
+		if (pl->timed_out)
+			break;
+
+		if (dists[tail] == SHRT_MAX)
+			goto next;
+
+		for (int i = 0; i < H * W; ++i)
+			max[i] = dists[i] == SHRT_MAX || w->jungle[i] == T_WALL || (T_SNAKE <= w->jungle[i] && w->jungle[i] < T_SNAKE_END) ? SHRT_MAX : -1;
+
+		int ntail = nthtail;
+		int head = w->yhead * W + w->xhead;
+		if (0 <= target) {
+			oldd = 0;
+			int i = target;
+			int oldmax = -1;
+			while (0 < dists[i] && dists[i] < SHRT_MAX) {
+				max[i] = oldmax;
+				for (enum direction d = 0; d < 4; ++d) {
+					int j = neighbor(w, i, (d + oldd) % 4);
+					if (j < 0 || dists[j] < 0 || dists[i] <= dists[j] || (T_SNAKE <= w->jungle[j] && w->jungle[j] < T_SNAKE_END))
+						continue;
+
+					i = j;
+					oldd = (d + oldd) % 4;
+					break;
+				}
+				oldmax = i;
+				--ntail;
+			}
+			/* assert(0 <= oldmax); */
+			max[i] = oldmax;
+			head = target;
+			assert(max[head] == -1);
+			oldd = opposite(oldd);
+		}
+
+		/* FIXME: If guessing takes too long, prefer catching tail
+		 * instead of shortest path to food. (Maybe bullshit.) */
+		/* Cells taken before search are decided by world and target. */
+		uint64_t taken = w->occupancy ^ zobrist_target(target);
+		if (longest(pl, w, max, head, ntail, tail, !ntail, taken, NULL)) {
+			if (target < 0) {
+				int ook = 0;
+				if (max[head] != SHRT_MAX) {
+					for (enum direction d = 0; d < 4; ++d) {
+						if (neighbor(w, head, d) == max[head]) {
+							ook = 1;
+							oldd = d;
+							break;
+						}
+					}
+
+#if 0
+					for (int z = max[head]; z != SHRT_MAX; z = max[z]) {
+						for (enum direction d = 0; d < 4; ++d) {
+							int y = z / W, x = z % W;
+							move(&y, &x, d);
+							if (y * W + x == max[z]) {
+								w->stepstack[w->nstepstack++] = d;
+								break;
+							}
+						}
+					}
+#endif
+
+				} else {
+					/* Tail is reachable using shortest path. */
+					oldd = 0;
+					int i = tail;
+					while (0 < dists[i] && dists[i] < SHRT_MAX) {
+						for (enum direction d = 0; d < 4; ++d) {
+							int j = neighbor(w, i, (d + oldd) % 4);
+							if (j < 0 || dists[j] < 0 || dists[i] <= dists[j] || (T_SNAKE <= w->jungle[j] && w->jungle[j] < T_SNAKE_END))
+								continue;
+
+							max[i] = SHRT_MAX;
+							i = j;
+							oldd = (d + oldd) % 4;
+							break;
+						}
+					}
+					ook = 1;
+					oldd = opposite(oldd);
+				}
+				assert(ook);
+			}
+			ok = 1;
+			break;
+		}
+
+	next:;
+		if (body_length(w) - 1 <= seg)
+			break;
+		int stride = pl->params->tail_stride;
+		if (body_length(w) - 1 - seg < stride)
+			stride = body_length(w) - 1 - seg;
+		seg += stride;
+		nthtail += stride;
+		tail = body_at(w, seg);
+	}
+
+	if (!ok) {
+		if (0 <= target && !pl->timed_out) {
+			/* TODO: Try other targets. */
+			target = -1;
+			goto retarget;
+		}
+		return 0;
+	}
+
+	w->next_snake_dir = oldd;
+	return 1;
+}
+
+static int
+is_lethal(struct world *w, int pos)
+{
+	enum type t = w->jungle[pos];
+	if (T_HEAD <= t && t < T_SNAKE_END)
+		/* Tail moves away in the same step. */
+		return 1 < body_frees_in(w, pos);
+	return t == T_WALL;
+}
+
+static int
+is_lethal_move(struct world *w, enum direction d)
+{
+	int y = w->yhead, x = w->xhead;
+	if (closed_edge(w, y * W + x, d))
+		return 1;
+	move(&y, &x, d);
+	return is_lethal(w, y * W + x);
+}
+
+/*
+ * Cells not crossing the snake grouped into connected regions. Cut cells,
+ * whose taking splits their region, are found with Tarjan's algorithm in
+ * the same pass, so how much room is left after a step is a lookup.
+ */
+struct regions {
+	/* -1 if not free. */
+	short region[H * W];
+	/* Indexed by region. */
+	short size[H * W];
+	/* Largest part of its region left when the cell is taken. */
+	short left[H * W];
+	/* Cells cut off below the cell in the search tree. */
+	short below[H * W];
+	short disc[H * W], low[H * W], subtree[H * W];
+	/* Search is done without recursion. */
+	short stack[H * W];
+	unsigned char dir[H * W];
+	int ndisc;
+};
+
+static void
+enter_region(struct regions *r, int i, int region)
+{
+	r->region[i] = region;
+	r->disc[i] = r->low[i] = r->ndisc++;
+	r->subtree[i] = 1;
+	r->below[i] = 0;
+	r->left[i] = 0;
+	r->dir[i] = 0;
+}
+
+static void
+visit_region(struct regions *r, struct world *w, int root, int region)
+{
+	int nstack = 0;
+	enter_region(r, root, region);
+	r->stack[nstack++] = root;
+	while (nstack) {
+		int i = r->stack[nstack - 1];
+		if (r->dir[i] < 4) {
+			enum direction d = r->dir[i]++;
+			if (closed_edge(w, i, d))
+				continue;
+			int y = i / W, x = i % W;
+			move(&y, &x, d);
+			int j = y * W + x;
+			if (is_lethal(w, j))
+				continue;
+
+			if (r->region[j] < 0) {
+				enter_region(r, j, region);
+				r->stack[nstack++] = j;
+			} else if (r->disc[j] < r->low[i]) {
+				r->low[i] = r->disc[j];
+			}
+			continue;
+		}
+
+		if (!--nstack)
+			break;
+		int p = r->stack[nstack - 1];
+		r->subtree[p] += r->subtree[i];
+		if (r->low[i] < r->low[p])
+			r->low[p] = r->low[i];
+		/* i cannot get around p. */
+		if (r->disc[p] <= r->low[i]) {
+			r->below[p] += r->subtree[i];
+			if (r->left[p] < r->subtree[i])
+				r->left[p] = r->subtree[i];
+		}
+	}
+}
+
+static void
+find_regions(struct regions *r, struct world *w)
+{
+	int nregions = 0;
+	r->ndisc = 0;
+	for (int i = 0; i < H * W; ++i)
+		r->region[i] = -1;
+
+	for (int i = 0; i < H * W; ++i) {
+		if (0 <= r->region[i] || is_lethal(w, i))
+			continue;
+		visit_region(r, w, i, nregions);
+		r->size[nregions++] = r->subtree[i];
+	}
+
+	for (int i = 0; i < H * W; ++i) {
+		if (r->region[i] < 0)
+			continue;
+		/* Whatever is not cut off stays connected above. */
+		int rest = r->size[r->region[i]] - 1 - r->below[i];
+		if (r->left[i] < rest)
+			r->left[i] = rest;
+	}
+}
+
+/* Choose a move into the largest free area, if any. */
+static int
+area_steer(struct planner *pl, struct world *w)
+{
+	struct regions r;
+	int best = -1;
+	int found = 0;
+	for (enum direction d = 0; d < 4; ++d) {
+		if (d == opposite(w->snake_dir))
+			continue;
+
+		if (is_lethal_move(w, d))
+			continue;
+
+		int y = w->yhead, x = w->xhead;
+		move(&y, &x, d);
+		if (best < 0)
+			w->next_snake_dir = d;
+
+		if (steer_expired(pl))
+			continue;
+
+		if (!found) {
+			find_regions(&r, w);
+			found = 1;
+		}
+		/* Cell stepped on counts too. */
+		int area = 1 + r.left[y * W + x];
+		if (best < area) {
+			best = area;
+			w->next_snake_dir = d;
+		}
+	}
+
+	return 0 <= best;
+}
+
+/*
+ * Anytime steering: Every stage refines the previous one and whatever has
+ * been computed by the deadline is used.
+ *
+ * (1) Any move that does not kill immediately.
+ * (2) Move into the largest free area.
+ * (3) Full plan: food then tail.
+ * (4) Tail-chasing plan. (Fallback of (3).)
+ */
+static void
+plan(struct planner *pl, struct world *w)
+{
+	/* Differs every tick without advancing the game's. */
+	pl->seed = w->seed ^ w->body_head;
+	/* Workspace is left from the last move, the rest starts over. */
+	pl->timed_out = 0;
+	pl->nodes = 0;
+
+	if (!area_steer(pl, w) || steer_expired(pl))
+		return;
+
+	enum direction d = w->next_snake_dir;
+	/* It does not know about closed edges. */
+	if (!old_steer(pl, w) || pl->timed_out || is_lethal_move(w, w->next_snake_dir))
+		w->next_snake_dir = d;
+}
+
+static void
+steer(struct world *w, struct timespec const *deadline)
+{
+	/* Kept between moves. */
+	static struct transpositions tt;
+	static struct planner pl = {
+		.params = &DEFAULT_AI_PARAMS,
+		.tt = &tt,
+	};
+	pl.deadline = *deadline;
+	plan(&pl, w);
+}
+
+enum {
+	ROLLOUT_DEPTH = 60,
+	ROLLOUT_DEATH = 1000,
+};
+
+/*
+ * Monte Carlo planner: For every legal direction play many random games on
+ * copies of the world and step where the average outcome is the best.
+ * Rollouts run on all cores until the deadline.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake, done;
+	int nthreads;
+	int nbusy;
+	unsigned generation;
+
+	struct world root;
+	struct timespec deadline;
+	int ncandidates;
+	enum direction candidates[3];
+	long sum[3];
+	long count[3];
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static long
+rollout(struct world *w, enum direction first)
+{
+	int score = w->score;
+	w->next_snake_dir = first;
+	for (int t = 0; t < ROLLOUT_DEPTH; ++t) {
+		if (!move_world(w))
+			return w->score - score - ROLLOUT_DEATH * (ROLLOUT_DEPTH - t) / ROLLOUT_DEPTH;
+		/* Snake disappeared in the hole. */
+		if (T_GROUND == w->jungle[w->yhead * W + w->xhead])
+			break;
+
+		enum direction safe[3];
+		int nsafe = 0;
+		for (enum direction d = 0; d < 4; ++d) {
+			if (d == opposite(w->snake_dir))
+				continue;
+			if (!is_lethal_move(w, d))
+				safe[nsafe++] = d;
+		}
+		if (nsafe)
+			w->next_snake_dir = safe[rand_r(&w->seed) % nsafe];
+	}
+	return w->score - score;
+}
+
+static void
+rollouts(unsigned *seed)
+{
+	long sum[3] = { 0 }, count[3] = { 0 };
+	struct world w;
+
+	pthread_mutex_lock(&pool.lock);
+	int n = pool.ncandidates;
+	struct timespec deadline = pool.deadline;
+	pthread_mutex_unlock(&pool.lock);
+
+	/* Root is not touched while anybody is busy. */
+	for (int i = 0; !expired(&deadline); i = (i + 1) % n) {
+		w = pool.root;
+		w.seed = rand_r(seed);
+		sum[i] += rollout(&w, pool.candidates[i]);
+		count[i] += 1;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	for (int i = 0; i < n; ++i) {
+		pool.sum[i] += sum[i];
+		pool.count[i] += count[i];
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void *
+rollout_worker(void *arg)
+{
+	unsigned seed = (unsigned)(size_t)arg;
+	unsigned generation = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&pool.lock);
+		while (generation == pool.generation)
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		generation = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+
+		rollouts(&seed);
+
+		pthread_mutex_lock(&pool.lock);
+		if (!--pool.nbusy)
+			pthread_cond_signal(&pool.done);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	return NULL;
+}
+
+static void
+mc_steer(struct world *w, struct timespec const *deadline)
+{
+	if (!pool.nthreads) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		/* Caller is working too. */
+		pool.nthreads = 1;
+		for (long i = 1; i < n; ++i) {
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, rollout_worker, (void *)(size_t)(w->seed + i)))
+				break;
+			pthread_detach(thread);
+			++pool.nthreads;
+		}
+	}
+
+	struct planner pl = {
+		.deadline = *deadline,
+	};
+	if (!area_steer(&pl, w) || steer_expired(&pl))
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.root = *w;
+	pool.deadline = *deadline;
+	pool.ncandidates = 0;
+	for (enum direction d = 0; d < 4; ++d) {
+		if (d == opposite(w->snake_dir))
+			continue;
+		if (is_lethal_move(w, d))
+			continue;
+		pool.sum[pool.ncandidates] = 0;
+		pool.count[pool.ncandidates] = 0;
+		pool.candidates[pool.ncandidates++] = d;
+	}
+	pool.nbusy = pool.nthreads - 1;
+	++pool.generation;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+
+	unsigned seed = w->seed;
+	rollouts(&seed);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.nbusy)
+		pthread_cond_wait(&pool.done, &pool.lock);
+
+	/* Compare averages: sum[i] / count[i] < sum[j] / count[j]. */
+	int best = -1;
+	for (int i = 0; i < pool.ncandidates; ++i) {
+		if (!pool.count[i])
+			continue;
+		if (best < 0 || pool.sum[best] * pool.count[i] < pool.sum[i] * pool.count[best])
+			best = i;
+	}
+	if (0 <= best)
+		w->next_snake_dir = pool.candidates[best];
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * External engine behind -a exec:CMD. It reads observations on stdin and
+ * answers every one with a byte on stdout: direction (enum direction) or
+ * anything else to keep going. Answer missing the deadline is skipped and
+ * snake keeps going; late answers are thrown away when they come.
+ *
+ * Observation is a header followed by nchanges cells changed since the
+ * previous observation of the same game; the first one has all cells.
+ * Headless games run side by side, so several observations may be in
+ * flight. Answers come in the same order.
+ */
+struct bot_header {
+	uint16_t game;
+	uint16_t nchanges;
+	uint32_t tick;
+	uint8_t height, width;
+	uint8_t yhead, xhead;
+	uint8_t ytail, xtail;
+	uint8_t dir;
+	uint8_t unused;
+};
+
+struct bot_cell {
+	uint8_t y, x;
+	/* enum type */
+	uint8_t type;
+};
+
+/* What the bot knows about a game. */
+struct bot_view {
+	unsigned tick;
+	char seen[H * W];
+};
+
+static struct {
+	char const *command;
+	pid_t pid;
+	int to_fd, from_fd;
+	/* Answers still to come for skipped observations. */
+	int owed;
+	long nanswers;
+	long nlate;
+	long total_ns;
+	long max_ns;
+} bot = {
+	.to_fd = -1,
+	.from_fd = -1,
+};
+
+static long
+monotonic_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void
+stop_bot(void)
+{
+	/* Closed stdin tells it to go. */
+	if (0 <= bot.to_fd) {
+		close(bot.to_fd);
+		close(bot.from_fd);
+		bot.to_fd = bot.from_fd = -1;
+	}
+	waitpid(bot.pid, NULL, 0);
+
+	long n = bot.nanswers - bot.nlate;
+	fprintf(stderr, "%s: %ld moves, %ld late, %.1f us mean, %.1f us max\n",
+			bot.command, bot.nanswers, bot.nlate,
+			n ? bot.total_ns / n / 1e3 : 0., bot.max_ns / 1e3);
+}
+
+static int
+start_bot(void)
+{
+	int to[2], from[2];
+	if (pipe2(to, O_CLOEXEC) < 0)
+		goto fail;
+	if (pipe2(from, O_CLOEXEC) < 0) {
+		close(to[0]);
+		close(to[1]);
+		goto fail;
+	}
+
+	bot.pid = fork();
+	if (!bot.pid) {
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		dup2(to[0], STDIN_FILENO);
+		dup2(from[1], STDOUT_FILENO);
+		execl("/bin/sh", "sh", "-c", bot.command, (char *)NULL);
+		_exit(127);
+	}
+	close(to[0]);
+	close(from[1]);
+	if (bot.pid < 0) {
+		close(to[1]);
+		close(from[0]);
+		goto fail;
+	}
+
+	bot.to_fd = to[1];
+	bot.from_fd = from[0];
+	atexit(stop_bot);
+	return 0;
+
+fail:
+	fprintf(stderr, "%s: %s\n", bot.command, strerror(errno));
+	return -1;
+}
+
+/* Bot is gone. Play on without it. */
+static void
+lose_bot(void)
+{
+	close(bot.to_fd);
+	close(bot.from_fd);
+	bot.to_fd = bot.from_fd = -1;
+}
+
+static void
+send_observation(struct bot_view *v, struct world const *w, int game)
+{
+	if (bot.to_fd < 0)
+		return;
+
+	static char buf[sizeof(struct bot_header) + H * W * sizeof(struct bot_cell)];
+	struct bot_cell *cells = (struct bot_cell *)(buf + sizeof(struct bot_header));
+	int n = 0;
+	for (int i = 0; i < H * W; ++i)
+		if (!v->tick || v->seen[i] != w->jungle[i]) {
+			cells[n].y = i / W;
+			cells[n].x = i % W;
+			cells[n].type = w->jungle[i];
+			++n;
+		}
+	memcpy(v->seen, w->jungle, sizeof v->seen);
+
+	struct bot_header hdr = {
+		.game = game,
+		.nchanges = n,
+		.tick = v->tick++,
+		.height = H,
+		.width = W,
+		.yhead = w->yhead,
+		.xhead = w->xhead,
+		.ytail = w->ytail,
+		.xtail = w->xtail,
+		.dir = w->snake_dir,
+	};
+	memcpy(buf, &hdr, sizeof hdr);
+
+	size_t size = sizeof hdr + n * sizeof *cells;
+	for (size_t off = 0; off < size;) {
+		ssize_t k = write(bot.to_fd, buf + off, size - off);
+		if (k < 0 && EINTR == errno)
+			continue;
+		if (k <= 0) {
+			lose_bot();
+			return;
+		}
+		off += k;
+	}
+}
+
+/* Next answer of bot or -1 if it did not come in time. */
+static int
+receive_move(long sent_ns, struct timespec const *deadline)
+{
+	if (bot.from_fd < 0)
+		return -1;
+
+	struct pollfd pfd;
+	pfd.fd = bot.from_fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		struct timespec timeout;
+		clock_gettime(CLOCK_MONOTONIC, &timeout);
+		timeout.tv_sec = deadline->tv_sec - timeout.tv_sec;
+		timeout.tv_nsec = deadline->tv_nsec - timeout.tv_nsec;
+		timeout.tv_sec -= timeout.tv_nsec < 0;
+		timeout.tv_nsec += timeout.tv_nsec < 0 ? 1000000000L : 0;
+		if (timeout.tv_sec < 0)
+			timeout.tv_sec = timeout.tv_nsec = 0;
+
+		int rc = ppoll(&pfd, 1, &timeout, NULL);
+		if (rc < 0)
+			continue;
+		if (!rc) {
+			++bot.owed;
+			++bot.nlate;
+			++bot.nanswers;
+			return -1;
+		}
+
+		unsigned char answer;
+		if (1 != read(bot.from_fd, &answer, sizeof answer)) {
+			lose_bot();
+			return -1;
+		}
+		if (bot.owed) {
+			--bot.owed;
+			continue;
+		}
+
+		long ns = monotonic_ns() - sent_ns;
+		++bot.nanswers;
+		bot.total_ns += ns;
+		if (bot.max_ns < ns)
+			bot.max_ns = ns;
+		return answer < 4 ? answer : -1;
+	}
+}
+
+static void
+exec_steer(struct world *w, struct timespec const *deadline)
+{
+	static struct bot_view view;
+	long sent_ns = monotonic_ns();
+	send_observation(&view, w, 0);
+	int d = receive_move(sent_ns, deadline);
+	if (0 <= d)
+		w->next_snake_dir = d;
+}
+
+static struct ai const EXEC_AI = { "exec", exec_steer };
+
+static struct ai const AIS[] = {
+	{ "old", steer },
+	{ "mc", mc_steer },
+};
+
+static int read_signals(void);
+
+/* Direction for key or -1. */
+static int
+key_direction(char key)
+{
+	switch (key) {
+	case '\033':
+	case '[':
+		/* Explicitly ignore. */
+		/* A-D is for \033[X arrow keys. */
+		return -1;
+
+	case 'h':
+	case 'a':
+	case 'D':
+	case '4':
+		return LEFT;
+
+	case 'j':
+	case 's':
+	case 'B':
+	case '5':
+	case '2':
+		return DOWN;
+
+	case 'k':
+	case 'w':
+	case 'A':
+	case '8':
+		return UP;
+
+	case 'l':
+	case 'd':
+	case 'C':
+	case '6':
+		return RIGHT;
+
+	default:
+		return -1;
+	}
+}
+
+static void
+run(void)
+{
+	struct world *w = &world;
+
+	static long const NSEC_PER_MSEC = 1000000;
+	static long const NSEC_PER_SEC = NSEC_PER_MSEC * 1000;
+
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	/* Left for signal_fd. */
+	sigaddset(&sigmask, SIGCONT);
+	sigaddset(&sigmask, SIGWINCH);
+
+	struct pollfd fds[3];
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = spectator_fd;
+	fds[1].events = POLLIN;
+	fds[2].fd = signal_fd;
+	fds[2].events = POLLIN;
+
+	draw(w);
+	publish_world(w, 0);
+	struct timespec last_frame;
+	clock_gettime(CLOCK_MONOTONIC, &last_frame);
+
+	for (;;) {
+		enum type head = w->jungle[w->yhead * W + w->xhead];
+		if (T_GROUND == head)
+			break;
+		int in_hole = T_HOLE == head;
+		int frame_duration = (computer ? COMPUTER_SPEED_DELAYS : SPEED_DELAYS)[w->speed - 1] >> in_hole;
+
+		struct timespec next_frame;
+		next_frame.tv_sec = last_frame.tv_sec;
+		next_frame.tv_nsec = last_frame.tv_nsec + frame_duration * NSEC_PER_MSEC;
+		next_frame.tv_sec += NSEC_PER_SEC <= next_frame.tv_nsec;
+		next_frame.tv_nsec -= NSEC_PER_SEC <= next_frame.tv_nsec ? NSEC_PER_SEC : 0;
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		struct timespec timeout;
+		timeout.tv_sec = next_frame.tv_sec - now.tv_sec;
+		timeout.tv_nsec = next_frame.tv_nsec - now.tv_nsec;
+		timeout.tv_sec -= timeout.tv_nsec < 0;
+		timeout.tv_nsec += timeout.tv_nsec < 0 ? NSEC_PER_SEC : 0;
+
+		/* Missed frame. */
+		if (timeout.tv_sec < 0) {
+			timeout.tv_sec = 0;
+			timeout.tv_nsec = 0;
+		}
+
+		int rc = ppoll(fds, ARRAY_SIZE(fds), paused ? NULL : &timeout, &sigmask);
+		if (rc < 0)
+			continue;
+
+		if (!rc) {
+			if (computer) {
+				/* Leave half of the frame for the rest. */
+				struct timespec deadline;
+				clock_gettime(CLOCK_MONOTONIC, &deadline);
+				deadline.tv_nsec += frame_duration * NSEC_PER_MSEC / 2;
+				deadline.tv_sec += deadline.tv_nsec / NSEC_PER_SEC;
+				deadline.tv_nsec %= NSEC_PER_SEC;
+				computer->steer(w, &deadline);
+			}
+
+			if (!move_world(w)) {
+				w->yhead = -1;
+				w->xhead = -1;
+				publish_world(w, 1);
+				return;
+			}
+
+			draw(w);
+			send_keyframe(w);
+			publish_world(w, 1);
+			if (timeout.tv_sec || timeout.tv_nsec)
+				/* next_frame + frame_duration (likely) points to the future. */
+				last_frame = next_frame;
+			else
+				/* next_frame + frame_duration < now, catch up. */
+				clock_gettime(CLOCK_MONOTONIC, &last_frame);
+			continue;
+		}
+
+		if (fds[1].revents)
+			accept_spectators(w);
+
+		if (fds[2].revents && read_signals()) {
+			/* Once with the next frame, however many came. */
+			forget_screen(w);
+			if (paused)
+				draw(w);
+		}
+
+		if (!fds[0].revents)
+			continue;
+
+		if (~POLLIN & fds[0].revents)
+			exit(EXIT_FAILURE);
+
+		char key;
+		if (1 != read(fds[0].fd, &key, sizeof key))
+			continue;
+
+		if (mouse) switch (key) {
+		case 'A':
+			w->next_snake_dir = turn_right(w->snake_dir);
+			paused = 0;
+			break;
+
+		case 'B':
+			w->next_snake_dir = turn_left(w->snake_dir);
+			paused = 0;
+			break;
+
+		case ' ':
+		case 'p':
+			paused ^= 1;
+			break;
+		} else switch (key) {
+		case ' ':
+		case 'p':
+			paused ^= 1;
+			break;
+
+		default:
+		{
+			int d = key_direction(key);
+			if (0 <= d) {
+				w->next_snake_dir = d;
+				paused = 0;
+			}
+		}
+			break;
+		}
+	}
+}
+
+static void
+plant_snake(struct world *w, int y, int x, enum direction d)
+{
+	w->ytail = w->yhead = y;
+	w->xtail = w->xhead = x;
+	w->next_snake_dir = w->snake_dir = d;
+	plant_yx(w, w->yhead, w->xhead, T_HEAD + w->snake_dir);
+	w->body_tail = w->body_head = 0;
+	push_body(w, y * W + x);
+}
+
+static void
+plant_map_classic(struct world *w)
+{
+	plant_snake(w, 12, 18, LEFT);
+}
+
+static void
+walls_around(struct world *w)
+{
+	plant_yxh(w, 0, 0, W, T_WALL);
+	plant_yxv(w, 0, 0, H, T_WALL);
+	plant_yxv(w, 0, W - 1, H, T_WALL);
+	plant_yxh(w, H - 1, 0, W, T_WALL);
+}
+
+static void
+walls_corners(struct world *w)
+{
+	int Py = 7;
+
+	/* Going clockwise starting from top left corner. */
+	plant_yxv(w, 0, 0, 3, T_WALL);
+	plant_yx(w, 0, 1, T_WALL);
+	plant_yx(w, 0, W - 2, T_WALL);
+	plant_yxv(w, 0, W - 1, 3, T_WALL);
+	plant_yxv(w, H - 3, W - 1, 3, T_WALL);
+	plant_yx(w, H - 1, W - 2, T_WALL);
+	plant_yx(w, H - 1, 1, T_WALL);
+	plant_yxv(w, H - 3, 0, 3, T_WALL);
+	/* Bars. */
+	int y = (H - Py) / 2 - 1, x = W / 4, xn = W - 2 * x;
+	plant_yxh(w, y, x, xn, T_WALL);
+	plant_yxh(w, H - 1 - y, x, xn, T_WALL);
+}
+
+static void
+walls_whirpool(struct world *w)
+{
+	int Pc = 1;
+	int Px = 3;
+
+	int yn = (H - Pc) / 2, xn = (W - Pc) / 2;
+	int yoff = yn - Px - 1, xoff = xn + Px + 1;
+	plant_yxh(w, yoff, 0, xn, T_WALL);
+	plant_yxh(w, H - 1 - yoff, W - xn, xn, T_WALL);
+	plant_yxv(w, 0, xoff, yn, T_WALL);
+	plant_yxv(w, H - yn, W - 1 - xoff, yn, T_WALL);
+}
+
+static void
+walls_cross(struct world *w)
+{
+	plant_yxh(w, H / 2, W / 2 - W / 4, W / 2 | 1, T_WALL);
+	plant_yxv(w, H / 2 - H / 4, W / 2, H / 2 | 1, T_WALL);
+}
+
+static void
+walls_four(struct world *w)
+{
+	plant_yxh(w, H / 2, 0, W, T_WALL);
+	plant_yxv(w, 0, W / 2, H, T_WALL);
+}
+
+static void
+walls_vslit(struct world *w)
+{
+	walls_around(w);
+	plant_yxv(w, 0, W / 2, H, T_WALL);
+	plant_yx(w, H / 2 - 1, W / 2, T_GROUND);
+	plant_yx(w, H / 2 + 1, W / 2, T_GROUND);
+}
+
+static void
+walls_hslit(struct world *w)
+{
+	walls_around(w);
+	plant_yxh(w, H / 2, 0, W, T_WALL);
+	plant_yx(w, H / 2, W / 2 - 1, T_GROUND);
+	plant_yx(w, H / 2, W / 2 + 1, T_GROUND);
+}
+
+/* Walls of built-in maps, compiled once and copied into jungle. */
+enum {
+	L_AROUND,
+	L_CORNERS,
+	L_WHIRPOOL,
+	L_CROSS,
+	L_FOUR,
+	L_VSLIT,
+	L_HSLIT,
+	L_COUNT,
+};
+
+static void (*const LAYOUT_WALLS[L_COUNT])(struct world *) = {
+	[L_AROUND] = walls_around,
+	[L_CORNERS] = walls_corners,
+	[L_WHIRPOOL] = walls_whirpool,
+	[L_CROSS] = walls_cross,
+	[L_FOUR] = walls_four,
+	[L_VSLIT] = walls_vslit,
+	[L_HSLIT] = walls_hslit,
+};
+
+static struct layout layouts[L_COUNT];
+static pthread_once_t layouts_once = PTHREAD_ONCE_INIT;
+
+/* Fill free cells and hash from jungle. */
+static void
+finish_layout(struct layout *l)
+{
+	l->nfree_cells = 0;
+	for (int pos = 0; pos < H * W; ++pos)
+		if (T_GROUND == l->jungle[pos])
+			l->free_cells[l->nfree_cells++] = pos;
+	l->occupancy = hash_occupancy(l->jungle);
+}
+
+static void
+compile_layouts(void)
+{
+	for (int i = 0; i < L_COUNT; ++i) {
+		struct world w = { 0 };
+		fire(&w);
+		LAYOUT_WALLS[i](&w);
+		memcpy(layouts[i].jungle, w.jungle, sizeof w.jungle);
+		layouts[i].spawn = -1;
+		layouts[i].spawn_dir = -1;
+		finish_layout(&layouts[i]);
+	}
+}
+
+static void
+enter_layout(struct world *w, struct layout const *l)
+{
+	memcpy(w->jungle, l->jungle, sizeof w->jungle);
+	w->occupancy = l->occupancy;
+	w->nowrap = l->nowrap;
+}
+
+static void
+enter_builtin_layout(struct world *w, int i)
+{
+	pthread_once(&layouts_once, compile_layouts);
+	enter_layout(w, &layouts[i]);
+}
+
+static void
+plant_map_around(struct world *w)
+{
+	enter_builtin_layout(w, L_AROUND);
+	plant_snake(w, H / 2, W / 2, rand_r(&w->seed) % 4);
+}
+
+static void
+plant_map_corners(struct world *w)
+{
+	enter_builtin_layout(w, L_CORNERS);
+	plant_snake(w, H / 2 + rand_r(&w->seed) % 4 - 2, W / 2, rand_r(&w->seed) % 2 ? LEFT : RIGHT);
+}
+
+static void
+plant_map_whirpool(struct world *w)
+{
+	enter_builtin_layout(w, L_WHIRPOOL);
+	plant_snake(w, H / 2, W / 2, rand_r(&w->seed) % 4);
+}
+
+static void
+plant_map_cross(struct world *w)
+{
+	enter_builtin_layout(w, L_CROSS);
+	int y = rand_r(&w->seed) % 2 ? H - 1 - H / 8 : H / 8;
+	int x = rand_r(&w->seed) % 2 ? W - 1 - W / 8 : W / 8;
+	plant_snake(w, y, x, rand_r(&w->seed) % 4);
+}
+
+static void
+plant_map_four(struct world *w)
+{
+	enter_builtin_layout(w, L_FOUR);
+	int y = H / 4 + (rand_r(&w->seed) % 2 ? H / 2 : 0);
+	int x = W / 4 + (rand_r(&w->seed) % 2 ? W / 2 : 0);
+	enum direction d = rand_r(&w->seed) % 2
+		? (y < H / 2 ? UP : DOWN)
+		: (x < W / 2 ? LEFT : RIGHT);
+	plant_snake(w, y, x, d);
+}
+
+static void
+plant_map_slit(struct world *w)
+{
+	enum direction d;
+	int y, x;
+	if (rand_r(&w->seed) % 2) {
+		enter_builtin_layout(w, L_VSLIT);
+		d = rand_r(&w->seed) % 2 ? LEFT : RIGHT;
+		y = H / 2 + (rand_r(&w->seed) % 2 ? 1 : -1);
+		x = W / 4 + (RIGHT == d ? 0 : W / 2);
+	} else {
+		enter_builtin_layout(w, L_HSLIT);
+		d = rand_r(&w->seed) % 2 ? UP : DOWN;
+		y = H / 4 + (DOWN == d ? 0 : H / 2);
+		x = W / 2 + (rand_r(&w->seed) % 2 ? 1 : -1);
+	}
+	plant_snake(w, y, x, d);
+}
+
+static void plant_random_map(struct world *w);
 
-			if (!(T_SNAKE <= jungle[y * W + x] && jungle[y * W + x] < T_SNAKE_END)) {
-				if (next[y * W + x] < 0) {
-					next[y * W + x] = next[i];
-					next[i] = y * W + x;
+static struct map const MAPS[] = {
+	{ "RANDOM", plant_random_map },
+	{ "CLASSIC", plant_map_classic },
+	{ "AROUND", plant_map_around },
+	{ "CORNERS", plant_map_corners },
+	{ "CROSS", plant_map_cross },
+	{ "WHIRPOOL", plant_map_whirpool },
+	{ "FOUR", plant_map_four },
+	{ "SLIT", plant_map_slit },
+};
+
+static void
+plant_random_map(struct world *w)
+{
+	/* Anything but myself. */
+	MAPS[1 + rand_r(&w->seed) % (ARRAY_SIZE(MAPS) - 1)].plant(w);
+}
+
+static int
+find_map(char const *name)
+{
+	for (int i = 0; i < ARRAY_SIZE(MAPS); ++i)
+		if (!strcmp(name, MAPS[i].name))
+			return i;
+	return -1;
+}
+
+static struct layout custom_layout;
+static struct map custom_map;
+
+static void
+plant_custom_map(struct world *w)
+{
+	struct layout const *l = &custom_layout;
+
+	enter_layout(w, l);
+
+	int pos = l->spawn;
+	if (pos < 0)
+		pos = l->free_cells[rand_r(&w->seed) % l->nfree_cells];
+	int d = l->spawn_dir;
+	if (d < 0)
+		d = rand_r(&w->seed) % 4;
+	plant_snake(w, pos / W, pos % W, d);
+}
+
+/*
+ * Map file looks like:
+ *
+ *   ; Comment.
+ *   name BOX
+ *   nowrap top bottom
+ *   #####################
+ *   #...................#
+ *   #........>..........#
+ *   ...
+ *
+ * Board has H lines of W cells: "#" is wall, "." is ground, one of "^>v<"
+ * is the snake looking that way, "@" is the snake looking anywhere. Snake
+ * appears on a random free cell if not given.
+ */
+static int
+load_map(char const *path)
+{
+	static char const EDGES[][8] = {
+		[UP] = "top",
+		[RIGHT] = "right",
+		[DOWN] = "bottom",
+		[LEFT] = "left",
+	};
+
+	struct layout *l = &custom_layout;
+	memset(l, 0, sizeof *l);
+	l->spawn = -1;
+	l->spawn_dir = -1;
+
+	char const *base = strrchr(path, '/');
+	snprintf(custom_map.name, sizeof custom_map.name, "%s", base ? base + 1 : path);
+	custom_map.plant = plant_custom_map;
+
+	FILE *stream = fopen(path, "re");
+	if (!stream) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	char line[256];
+	int y = 0;
+	int lineno = 0;
+	for (lineno = 1; fgets(line, sizeof line, stream); ++lineno) {
+		line[strcspn(line, "\n")] = '\0';
+		if (';' == *line || !*line)
+			continue;
+
+		char *value = strchr(line, ' ');
+		if (value) {
+			*value++ = '\0';
+			if (!strcmp(line, "name")) {
+				snprintf(custom_map.name, sizeof custom_map.name, "%s", value);
+			} else if (!strcmp(line, "nowrap")) {
+				for (char *edge; (edge = strtok(value, " ")); value = NULL) {
+					int d;
+					for (d = 0; d < 4 && strcmp(edge, EDGES[d]); ++d)
+						;
+					if (4 <= d)
+						goto fail;
+					l->nowrap |= 1 << d;
 				}
+			} else {
+				goto fail;
+			}
+			continue;
+		}
+
+		if (H <= y || W != strlen(line))
+			goto fail;
+		for (int x = 0; x < W; ++x) {
+			int pos = y * W + x;
+			char const *dir;
+			l->jungle[pos] = '#' == line[x] ? T_WALL : T_GROUND;
+			if ('@' == line[x]) {
+				l->spawn = pos;
+			} else if ((dir = strchr("^>v<", line[x]))) {
+				l->spawn = pos;
+				l->spawn_dir = dir - "^>v<";
+			} else if (!strchr(".#", line[x])) {
+				goto fail;
 			}
+		}
+		++y;
+	}
+	if (H != y)
+		goto fail;
+	fclose(stream);
+
+	finish_layout(l);
+	if (!l->nfree_cells) {
+		fprintf(stderr, "%s: No room for snake\n", path);
+		return -1;
+	}
+	return 0;
+
+fail:
+	fprintf(stderr, "%s:%d: Invalid map\n", path, lineno);
+	fclose(stream);
+	return -1;
+}
+
+static void enter_map(struct map const *map);
+
+static void
+marathon(void)
+{
+	struct world *w = &world;
+
+	w->playing = 1;
+	run();
+	w->playing = 0;
+	if (0 <= w->yhead)
+		enter_map(&MAPS[0]);
+}
+
+static void
+enter_map(struct map const *map)
+{
+	struct world *w = &world;
+
+	fire(w);
+	map->plant(w);
+	plant_random(w, T_APPLE);
+	marathon();
+}
+
+enum {
+	TUNE_SEEDS = 3,
+	TUNE_TICKS = 500,
+	TUNE_BUDGET_MSEC = 10,
+};
+
+struct play_stats {
+	long ticks;
+	long score;
+	long steer_ns;
+	int max_length;
+	char const *death;
+	/* Steer time of every tick, if not NULL. */
+	long *steer_samples;
+};
+
+static long
+thread_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
 
-			dists[y * W + x] = dist;
+static void
+start_play(struct world *w, struct map const *map)
+{
+	w->score = 0;
+	fire(w);
+	map->plant(w);
+	plant_random(w, T_APPLE);
+}
+
+/* Move where snake is steered. Return 0 if it died. */
+static int
+step_play(struct world *w, struct play_stats *stats)
+{
+	/* What it runs into, if it dies. */
+	enum direction d = w->next_snake_dir != opposite(w->snake_dir)
+		? w->next_snake_dir
+		: w->snake_dir;
+	int y = w->yhead, x = w->xhead;
+	int edge = closed_edge(w, y * W + x, d);
+	move(&y, &x, d);
+	enum type ahead = w->jungle[y * W + x];
+
+	if (!move_world(w)) {
+		stats->death = edge ? "edge" : T_WALL == ahead ? "wall" : "snake";
+		return 0;
+	}
+	++stats->ticks;
+	if (stats->max_length < body_length(w))
+		stats->max_length = body_length(w);
+
+	/* Snake disappeared in the hole. */
+	if (T_GROUND == w->jungle[w->yhead * W + w->xhead]) {
+		fire(w);
+		MAPS[0].plant(w);
+		plant_random(w, T_APPLE);
+	}
+	return 1;
+}
+
+/*
+ * Let computer play a game on map without terminal, by planner with params
+ * or by engine if there is one. Planner is timed by CPU time of its
+ * thread, engine by wall clock since it may have threads of its own.
+ */
+static void
+play(struct world *w, struct map const *map, struct ai_params const *params,
+		struct ai const *engine, long max_ticks, struct play_stats *stats)
+{
+	start_play(w, map);
+	/* Plays on without it if there is no memory. */
+	struct transpositions *tt = calloc(1, sizeof *tt);
+	struct planner pl = {
+		.params = params,
+		.tt = tt,
+	};
+
+	long ticks;
+	for (ticks = 0; ticks < max_ticks; ++ticks) {
+		clock_gettime(CLOCK_MONOTONIC, &pl.deadline);
+		pl.deadline.tv_nsec += TUNE_BUDGET_MSEC * 1000000L;
+		pl.deadline.tv_sec += pl.deadline.tv_nsec / 1000000000L;
+		pl.deadline.tv_nsec %= 1000000000L;
+
+		long steer_ns;
+		if (engine) {
+			long start = monotonic_ns();
+			engine->steer(w, &pl.deadline);
+			steer_ns = monotonic_ns() - start;
+		} else {
+			long start = thread_ns();
+			plan(&pl, w);
+			steer_ns = thread_ns() - start;
 		}
+		stats->steer_ns += steer_ns;
+		if (stats->steer_samples)
+			stats->steer_samples[ticks] = steer_ns;
 
-		int oldi = i;
-		i = next[i];
-		next[oldi] = -1;
-		if (i < 0)
+		if (!step_play(w, stats))
 			break;
 	}
+	if (max_ticks <= ticks)
+		stats->death = "timeout";
 
+	stats->score += w->score;
+	free(tt);
+}
 
-	int anyfood = 0;
-	int api = -1;
-	int speci = -1;
-	for (int i = 0; i < H * W; ++i) {
-		anyfood |= T_APPLE == jungle[i];
-		if (dists[i] == INT_MAX)
-			continue;
-		if (T_APPLE == jungle[i]) {
-			api = i;
-		} else if (((T_FIRST_SFOOD <= jungle[i] && jungle[i] <= T_LAST_SFOOD) || jungle[i] == T_HOLE) && (speci < 0 || dists[i] < dists[speci])) {
-			speci = i;
+/*
+ * Let bot play games side by side. Observations of a round go out
+ * together, so bot may work on one while the others are on the way. Steer
+ * time is the wall time until the answer.
+ */
+static int
+play_bot(struct world *ws, struct map const *map, int ngames,
+		long max_ticks, struct play_stats *stats)
+{
+	struct bot_view *views = calloc(ngames, sizeof *views);
+	long *sent_ns = calloc(ngames, sizeof *sent_ns);
+	char *alive = calloc(ngames, sizeof *alive);
+	if (!views || !sent_ns || !alive) {
+		free(alive);
+		free(sent_ns);
+		free(views);
+		return -1;
+	}
+
+	for (int i = 0; i < ngames; ++i) {
+		start_play(&ws[i], map);
+		alive[i] = 1;
+	}
+
+	long ticks;
+	for (ticks = 0; ticks < max_ticks; ++ticks) {
+		int nalive = 0;
+		for (int i = 0; i < ngames; ++i)
+			if (alive[i]) {
+				sent_ns[i] = monotonic_ns();
+				send_observation(&views[i], &ws[i], i);
+				++nalive;
+			}
+		if (!nalive)
+			break;
+
+		/* Each game has its budget. */
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += nalive * TUNE_BUDGET_MSEC * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+
+		for (int i = 0; i < ngames; ++i) {
+			if (!alive[i])
+				continue;
+			int d = receive_move(sent_ns[i], &deadline);
+			if (0 <= d)
+				ws[i].next_snake_dir = d;
+			long steer_ns = monotonic_ns() - sent_ns[i];
+			stats[i].steer_ns += steer_ns;
+			if (stats[i].steer_samples)
+				stats[i].steer_samples[ticks] = steer_ns;
+			alive[i] = step_play(&ws[i], &stats[i]);
 		}
 	}
-	if (!anyfood)
-		return;
-	int target = speci;
-	if (target < 0)
-		target = api;
+	for (int i = 0; i < ngames; ++i) {
+		if (alive[i])
+			stats[i].death = "timeout";
+		stats[i].score += ws[i].score;
+	}
 
-retarget:;
+	free(alive);
+	free(sent_ns);
+	free(views);
+	return 0;
+}
 
-	int max[H * W];
+struct tune_candidate {
+	struct ai_params params;
+	struct play_stats stats;
+	int ngames;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct tune_candidate *candidates;
+	int ncandidates;
+	struct map const *maps;
+	int nmaps;
+	int njobs;
+	int next_job;
+} tuner = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void *
+tune_worker(void *arg)
+{
+	(void)arg;
 
-	enum direction oldd = snake_dir;
-	int ok = 0;
-	int tail = ytail * W + xtail;
-	int nthtail = 1 + snake_growth;
 	for (;;) {
-		if (dists[tail] == INT_MAX)
-			goto next;
+		pthread_mutex_lock(&tuner.lock);
+		int job = tuner.next_job++;
+		pthread_mutex_unlock(&tuner.lock);
+		if (tuner.njobs <= job)
+			break;
 
-		for (int i = 0; i < H * W; ++i)
-			max[i] = dists[i] == INT_MAX || jungle[i] == T_WALL || (T_SNAKE <= jungle[i] && jungle[i] < T_SNAKE_END) ? INT_MAX : -1;
+		struct tune_candidate *c = &tuner.candidates[job % tuner.ncandidates];
+		job /= tuner.ncandidates;
+		int map = job % tuner.nmaps;
+		job /= tuner.nmaps;
+
+		struct world w = {
+			.speed = world.speed,
+			.max_bugs = world.max_bugs,
+			/* Same seeds for every candidate. Planner does not
+			 * draw from them, so rolls differ only where moves do. */
+			.seed = 1 + job * tuner.nmaps + map,
+		};
+		struct play_stats stats = { 0 };
+		play(&w, &tuner.maps[map], &c->params, NULL, TUNE_TICKS, &stats);
+
+		pthread_mutex_lock(&tuner.lock);
+		c->stats.ticks += stats.ticks;
+		c->stats.score += stats.score;
+		c->stats.steer_ns += stats.steer_ns;
+		c->ngames += 1;
+		pthread_mutex_unlock(&tuner.lock);
+	}
 
-		int ntail = nthtail;
-		int head = yhead * W + xhead;
-		if (0 <= target) {
-			oldd = 0;
-			int i = target;
-			int oldmax = -1;
-			while (0 < dists[i] && dists[i] < INT_MAX) {
-				max[i] = oldmax;
-				for (enum direction d = 0; d < 4; ++d) {
-					int y = i / W, x = i % W;
-					move(&y, &x, (d + oldd) % 4);
-					if (dists[y * W + x] < 0 || dists[i] <= dists[y * W + x] || (T_SNAKE <= jungle[y * W + x] && jungle[y * W + x] < T_SNAKE_END))
-						continue;
+	return NULL;
+}
 
-					i = y * W + x;
-					oldd = (d + oldd) % 4;
-					break;
-				}
-				oldmax = i;
-				--ntail;
-			}
-			/* assert(0 <= oldmax); */
-			max[i] = oldmax;
-			head = target;
-			assert(max[head] == -1);
-			oldd = opposite(oldd);
-			latest = __LINE__;
-		}
+enum {
+	BENCH_TICKS = 500,
+	/* Percent allowed below baseline. */
+	BENCH_SCORE_TOLERANCE = 10,
+	/* Only if baseline has speed. It depends on machine. */
+	BENCH_SPEED_TOLERANCE = 50,
+	/* Diff kernel is too fast to time once per frame. */
+	BENCH_DIFF_REPEAT = 100,
+};
 
-		/* FIXME: If guessing takes too long, prefer catching tail
-		 * instead of shortest path to food. (Maybe bullshit.) */
-		if (longest(max, head, ntail, tail, !ntail)) {
-			if (target < 0) {
-				int ook = 0;
-				if (max[head] != INT_MAX) {
-					for (enum direction d = 0; d < 4; ++d) {
-						int y = head / W, x = head % W;
-						move(&y, &x, d);
-						if (y * W + x == max[head]) {
-							ook = 1;
-							oldd = d;
-							latest = __LINE__;
-							break;
-						}
-					}
+static void
+print_json_string(char const *s)
+{
+	putchar('"');
+	for (; *s; ++s) {
+		if ('"' == *s || '\\' == *s)
+			putchar('\\');
+		if ((unsigned char)*s < ' ')
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
 
-#if 0
-					for (int z = max[head]; z != INT_MAX; z = max[z]) {
-						for (enum direction d = 0; d < 4; ++d) {
-							int y = z / W, x = z % W;
-							move(&y, &x, d);
-							if (y * W + x == max[z]) {
-								stepstack[nstepstack++] = d;
-								break;
-							}
-						}
-					}
-#endif
+static int
+compare_long(void const *a, void const *b)
+{
+	long x = *(long const *)a, y = *(long const *)b;
+	return (y < x) - (x < y);
+}
 
-				} else {
-					/* Tail is reachable using shortest path. */
-					oldd = 0;
-					int i = tail;
-					while (0 < dists[i] && dists[i] < INT_MAX) {
-						for (enum direction d = 0; d < 4; ++d) {
-							int y = i / W, x = i % W;
-							move(&y, &x, (d + oldd) % 4);
-							if (dists[y * W + x] < 0 || dists[i] <= dists[y * W + x] || (T_SNAKE <= jungle[y * W + x] && jungle[y * W + x] < T_SNAKE_END))
-								continue;
+/* Value of key in a flat JSON object, or NULL. */
+static char const *
+json_value(char const *json, char const *key)
+{
+	size_t n = strlen(key);
+	for (char const *p = json; (p = strchr(p, '"')); ++p)
+		if (!strncmp(p + 1, key, n) && !strncmp(p + 1 + n, "\":", 2))
+			return p + 1 + n + 2;
+	return NULL;
+}
 
-							max[i] = INT_MAX;
-							i = y * W + x;
-							oldd = (d + oldd) % 4;
-							break;
-						}
-					}
-					ook = 1;
-					oldd = opposite(oldd);
-					latest = __LINE__;
-				}
-				assert(ook);
+/*
+ * Play ngames fixed games on every map and print a JSON record for each,
+ * followed by a summary. If baseline_path is given, fail when summary falls
+ * behind the one stored there by more than the tolerance. Speed is only
+ * checked if baseline has it, and engine and bugs must be the same.
+ */
+static int
+bench(struct map const *maps, int nmaps, int ngames, char const *baseline_path)
+{
+	struct world *ws = calloc(ngames, sizeof *ws);
+	struct play_stats *stats = calloc(ngames, sizeof *stats);
+	long (*steer_samples)[BENCH_TICKS] = calloc(ngames, sizeof *steer_samples);
+	if (!ws || !stats || !steer_samples) {
+		perror("calloc");
+		free(steer_samples);
+		free(stats);
+		free(ws);
+		return EXIT_FAILURE;
+	}
+	long total_score = 0, total_ticks = 0;
+	/* Planner has parameters of its own here. */
+	struct ai const *engine = computer && &AIS[0] != computer ? computer : NULL;
+	char const *engine_name = engine ? engine->name : AIS[0].name;
+	/*
+	 * Planner is timed by CPU time of its thread, bot by wall clock from
+	 * observation to move, other engines by wall clock of their steering,
+	 * so they are not named the same.
+	 */
+	char const *timed =
+		!engine ? "steer" :
+		&EXEC_AI == engine ? "reply" :
+		"wall";
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int map = 0; map < nmaps; ++map) {
+		for (int game = 0; game < ngames; ++game) {
+			memset(&ws[game], 0, sizeof ws[game]);
+			ws[game].speed = world.speed;
+			ws[game].max_bugs = world.max_bugs;
+			ws[game].seed = 1 + game;
+			memset(&stats[game], 0, sizeof stats[game]);
+			stats[game].steer_samples = steer_samples[game];
+		}
+		if (&EXEC_AI == engine) {
+			if (play_bot(ws, &maps[map], ngames, BENCH_TICKS, stats) < 0) {
+				perror("calloc");
+				free(steer_samples);
+				free(stats);
+				free(ws);
+				return EXIT_FAILURE;
 			}
-			ok = 1;
-			break;
+		} else
+			for (int game = 0; game < ngames; ++game)
+				play(&ws[game], &maps[map], &DEFAULT_AI_PARAMS, engine, BENCH_TICKS, &stats[game]);
+
+		for (int game = 0; game < ngames; ++game) {
+			total_score += stats[game].score;
+			total_ticks += stats[game].ticks;
+
+			long p99 = 0;
+			if (stats[game].ticks) {
+				qsort(steer_samples[game], stats[game].ticks, sizeof **steer_samples, compare_long);
+				p99 = steer_samples[game][stats[game].ticks * 99 / 100];
+			}
+
+			printf("{\"engine\":");
+			print_json_string(engine_name);
+			printf(",\"map\":");
+			print_json_string(maps[map].name);
+			printf(",\"seed\":%u,\"speed\":%d,\"bugs\":%d,\"score\":%ld,\"ticks\":%ld"
+					",\"max_length\":%d,\"death\":\"%s\""
+					",\"%s_ms\":%.3f,\"p99_%s_us\":%.1f}\n",
+					1 + game, ws[game].speed, ws[game].max_bugs, stats[game].score, stats[game].ticks,
+					stats[game].max_length, stats[game].death,
+					timed, stats[game].steer_ns / 1e6, timed, p99 / 1e3);
 		}
+		fflush(stdout);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(steer_samples);
+	free(stats);
+	free(ws);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	double score = (double)total_score / (nmaps * ngames);
+	double tps = total_ticks / (0 < elapsed ? elapsed : 1);
+	printf("{\"engine\":");
+	print_json_string(engine_name);
+	printf(",\"bugs\":%d,\"games\":%d,\"score\":%.1f,\"ticks_per_sec\":%.1f}\n",
+			world.max_bugs, nmaps * ngames, score, tps);
+
+	if (!baseline_path)
+		return EXIT_SUCCESS;
+
+	FILE *stream = fopen(baseline_path, "re");
+	if (!stream) {
+		fprintf(stderr, "%s: %s\n", baseline_path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	char line[256];
+	if (!fgets(line, sizeof line, stream))
+		*line = '\0';
+	fclose(stream);
+	char const *base_engine = json_value(line, "engine");
+	char const *base_bugs = json_value(line, "bugs");
+	char const *base_score_value = json_value(line, "score");
+	char const *base_tps_value = json_value(line, "ticks_per_sec");
+	double base_score = base_score_value ? strtod(base_score_value, NULL) : 0;
+	double base_tps = base_tps_value ? strtod(base_tps_value, NULL) : 0;
+	if (!base_engine || !base_bugs || !base_score_value) {
+		fprintf(stderr, "%s: Invalid baseline\n", baseline_path);
+		return EXIT_FAILURE;
+	}
+
+	size_t n = strlen(engine_name);
+	if ('"' != *base_engine || strncmp(base_engine + 1, engine_name, n) || '"' != base_engine[1 + n]) {
+		fprintf(stderr, "%s: Baseline is not for engine %s\n", baseline_path, engine_name);
+		return EXIT_FAILURE;
+	}
+	if (atoi(base_bugs) != world.max_bugs) {
+		fprintf(stderr, "%s: Baseline is not for %d bugs\n", baseline_path, world.max_bugs);
+		return EXIT_FAILURE;
+	}
+
+	int ok = 1;
+	if (score * 100 < base_score * (100 - BENCH_SCORE_TOLERANCE)) {
+		fprintf(stderr, "Score dropped: %.1f, baseline %.1f\n", score, base_score);
+		ok = 0;
+	}
+	if (tps * 100 < base_tps * (100 - BENCH_SPEED_TOLERANCE)) {
+		fprintf(stderr, "Ticks per second dropped: %.1f, baseline %.1f\n", tps, base_tps);
+		ok = 0;
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Record frames of computer playing on maps then render them with every
+ * theme into memory.
+ */
+static int
+bench_render(struct map const *maps, int nmaps, int nframes)
+{
+	struct world *frames = malloc(nframes * sizeof *frames);
+	if (!frames) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
 
-	next:;
-		if (tail == yhead * W + xhead)
-			break;
-		enum direction d = (jungle[tail] - T_SNAKE) % 4;
-		int y = tail / W, x = tail % W;
-		move(&y, &x, d);
-		tail = y * W + x;
-		++nthtail;
+	struct world w = {
+		.speed = world.speed,
+		.max_bugs = world.max_bugs,
+		.seed = 1,
+	};
+	struct planner pl = {
+		.params = &DEFAULT_AI_PARAMS,
+	};
+	int map = 0;
+	fire(&w);
+	maps[map].plant(&w);
+	plant_random(&w, T_APPLE);
+	for (int i = 0; i < nframes; ++i) {
+		frames[i] = w;
+		/* As draw() leaves it. */
+		w.partially_damaged = 1;
+		w.num_damages = 0;
+		w.old_score = w.score;
+		w.old_timeout = bugs_timeout(&w);
+
+		clock_gettime(CLOCK_MONOTONIC, &pl.deadline);
+		pl.deadline.tv_nsec += TUNE_BUDGET_MSEC * 1000000L;
+		pl.deadline.tv_sec += pl.deadline.tv_nsec / 1000000000L;
+		pl.deadline.tv_nsec %= 1000000000L;
+		plan(&pl, &w);
+
+		if (!move_world(&w) || T_GROUND == w.jungle[w.yhead * W + w.xhead]) {
+			map = (map + 1) % nmaps;
+			w.score = 0;
+			fire(&w);
+			maps[map].plant(&w);
+			plant_random(&w, T_APPLE);
+		}
 	}
 
-	if (!ok) {
-		if (0 <= target) {
-			/* TODO: Try other targets. */
-			target = -1;
-			goto retarget;
+	/* Frames not tracked cell by cell go through diff_jungle(). */
+	printf("# theme\tns/frame\tbytes/frame\tdiffed%%\tns/diffed\tns/damaged\n");
+	for (int i = 0; i < ARRAY_SIZE(THEMES); ++i) {
+		compile_theme(&theme, THEMES[i].arts);
+		shown_valid = 0;
+
+		long ns[2] = { 0 }, bytes = 0;
+		int ndiffed = 0;
+		for (int k = 0; k < nframes; ++k) {
+			w = frames[k];
+			int diffed = !w.partially_damaged;
+			ndiffed += diffed;
+
+			struct timespec start, end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			render(&w);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			ns[diffed] += (end.tv_sec - start.tv_sec) * 1000000000L + end.tv_nsec - start.tv_nsec;
+
+			bytes += frame_size;
+			frame_size = 0;
 		}
-		paused = 1;
-		return;
+
+		int ndamaged = nframes - ndiffed;
+		printf("%s\t%.0f\t%.0f\t%.1f\t%.0f\t%.0f\n",
+				THEMES[i].name,
+				(double)(ns[0] + ns[1]) / nframes,
+				(double)bytes / nframes,
+				100.0 * ndiffed / nframes,
+				ndiffed ? (double)ns[1] / ndiffed : 0,
+				ndamaged ? (double)ns[0] / ndamaged : 0);
+	}
+
+	/* Diff kernel alone, between consecutive frames. */
+	printf("# kernel\tns/diff\tchanged/diff\n");
+	for (int scalar = 0; scalar < 2; ++scalar) {
+		long nchanged = 0;
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		/* Pair stays in cache, frames are far apart. */
+		for (int k = 1; k < nframes; ++k)
+			for (int r = 0; r < BENCH_DIFF_REPEAT; ++r) {
+				uint64_t changed[(H * W + 63) / 64] = { 0 };
+				if (scalar)
+					diff_cells_scalar(changed, frames[k - 1].jungle, frames[k].jungle, 0, H * W);
+				else
+					diff_cells(changed, frames[k - 1].jungle, frames[k].jungle, H * W);
+				for (int j = 0; j < ARRAY_SIZE(changed); ++j)
+					nchanged += __builtin_popcountll(changed[j]);
+			}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		long ndiffs = (long)BENCH_DIFF_REPEAT * (nframes - 1);
+		printf("%s\t%.1f\t%.1f\n",
+				scalar ? "scalar" : "best",
+				ndiffs ? ((end.tv_sec - start.tv_sec) * 1e9 + end.tv_nsec - start.tv_nsec) / ndiffs : 0,
+				ndiffs ? (double)nchanged / ndiffs : 0);
 	}
 
-	next_snake_dir = oldd;
+	free(frames);
+	return EXIT_SUCCESS;
 }
-static void
-steer(void)
+
+/*
+ * Grid search AI parameters over fixed seeds and maps, then print candidates
+ * that are not beaten both in average score and CPU time per tick.
+ */
+static int
+tune(struct map const *maps, int nmaps)
 {
-	old_steer();
+	static int const SPECIAL_FIRSTS[] = { 0, 1 };
+	static int const HOLES[] = { 0, 1 };
+	static int const RANDOM_BELOWS[] = { 0, 2, 8 };
+	static int const TAIL_STRIDES[] = { 1, 2, 4 };
+	static int const WARNSDORFFS[] = { 0, 1 };
+
+	struct tune_candidate candidates[
+		ARRAY_SIZE(SPECIAL_FIRSTS) * ARRAY_SIZE(HOLES) *
+		ARRAY_SIZE(RANDOM_BELOWS) * ARRAY_SIZE(TAIL_STRIDES) *
+		ARRAY_SIZE(WARNSDORFFS)
+	];
+	int n = 0;
+	for (int a = 0; a < ARRAY_SIZE(SPECIAL_FIRSTS); ++a)
+	for (int b = 0; b < ARRAY_SIZE(HOLES); ++b)
+	for (int c = 0; c < ARRAY_SIZE(RANDOM_BELOWS); ++c)
+	for (int d = 0; d < ARRAY_SIZE(TAIL_STRIDES); ++d)
+	for (int e = 0; e < ARRAY_SIZE(WARNSDORFFS); ++e) {
+		memset(&candidates[n], 0, sizeof *candidates);
+		candidates[n].params.special_first = SPECIAL_FIRSTS[a];
+		candidates[n].params.holes = HOLES[b];
+		candidates[n].params.random_below = RANDOM_BELOWS[c];
+		candidates[n].params.tail_stride = TAIL_STRIDES[d];
+		candidates[n].params.warnsdorff = WARNSDORFFS[e];
+		++n;
+	}
+
+	tuner.candidates = candidates;
+	tuner.ncandidates = n;
+	tuner.maps = maps;
+	tuner.nmaps = nmaps;
+	tuner.njobs = n * tuner.nmaps * TUNE_SEEDS;
+
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t threads[64];
+	int nstarted = 0;
+	while (nstarted < nthreads && nstarted < ARRAY_SIZE(threads) &&
+	       !pthread_create(&threads[nstarted], NULL, tune_worker, NULL))
+		++nstarted;
+	tune_worker(NULL);
+	while (nstarted)
+		pthread_join(threads[--nstarted], NULL);
+
+	double score[ARRAY_SIZE(candidates)], cost[ARRAY_SIZE(candidates)];
+	for (int i = 0; i < n; ++i) {
+		struct tune_candidate const *c = &candidates[i];
+		score[i] = (double)c->stats.score / c->ngames;
+		cost[i] = (double)c->stats.steer_ns / (c->stats.ticks ? c->stats.ticks : 1);
+	}
+
+	char hidden[ARRAY_SIZE(candidates)] = { 0 };
+	for (int i = 0; i < n; ++i)
+		for (int j = 0; j < n && !hidden[i]; ++j)
+			hidden[i] =
+				score[i] <= score[j] && cost[j] <= cost[i] &&
+				(score[i] < score[j] || cost[j] < cost[i]);
+
+	printf("# score\tus/tick\tspecial_first\tholes\trandom_below\ttail_stride\twarnsdorff\n");
+	for (;;) {
+		int best = -1;
+		for (int i = 0; i < n; ++i)
+			if (!hidden[i] && (best < 0 || cost[i] < cost[best]))
+				best = i;
+		if (best < 0)
+			break;
+		hidden[best] = 1;
+
+		struct ai_params const *params = &candidates[best].params;
+		printf("%.1f\t%.1f\t%d\t%d\t%d\t%d\t%d\n",
+				score[best], cost[best] / 1000,
+				params->special_first,
+				params->holes,
+				params->random_below,
+				params->tail_stride,
+				params->warnsdorff);
+	}
+
+	return EXIT_SUCCESS;
 }
 
 static void
-run(void)
+plant_button(struct world *w, int y, int x, char const *text)
 {
-	static long const NSEC_PER_MSEC = 1000000;
-	static long const NSEC_PER_SEC = NSEC_PER_MSEC * 1000;
+	plant_yx(w, y, x, T_HOLE);
+	plant_text(w, y, x + 2, text);
+}
 
-	sigset_t sigmask;
-	sigemptyset(&sigmask);
+static void
+enter_welcome_menu(void);
 
-	struct pollfd fd;
-	fd.fd = STDIN_FILENO;
-	fd.events = POLLIN;
+static void
+enter_speed_menu(void)
+{
+	struct world *w = &world;
 
-	draw();
-	struct timespec last_frame;
-	clock_gettime(CLOCK_MONOTONIC, &last_frame);
+	fire(w);
+	plant_ctext(w, 1, "SPEED");
+	plant_text(w, 3, 0, "SET");
+	plant_text(w, 3, W - 6, "SLOWER");
+	for (int i = 1; i <= 9; ++i) {
+		plant_yxh(w, 3 + i, (W - 9) / 2, 9 - i + 1, T_STAR);
+		plant_yx(w, 3 + i, 0, T_HOLE);
+		plant_yx(w, 3 + i, W - i, i == 9 ? T_WALL : T_HOLE);
+	}
+	plant_snake(w, 4 + (9 - w->speed), 1, RIGHT);
+	int x = W - 9;
+	plant_yx(w, 15, x - 1, T_EGG);
+	plant_yxv(w, 15, x, 4, T_WALL);
+	plant_yx(w, 16, x - 1, T_WALL);
+	plant_yx(w, 16, x + 1, T_SNAIL);
+	plant_yx(w, 17, x - 1, T_BEETLE);
+	plant_yxh(w, 17, x, 3, T_WALL);
+	plant_yx(w, 17, x + 3, T_EGG);
+	plant_text(w, 15, 1, "BACK");
+	plant_yxh(w, 16, 1, 4, T_HOLE);
+	plant_yx(w, 16, 0, T_WALL);
+	plant_random(w, T_APPLE);
 
-	for (;;) {
-		enum type head = jungle[yhead * W + xhead];
-		if (T_GROUND == head)
-			break;
-		int in_hole = T_HOLE == head;
-		int frame_duration = (computer ? COMPUTER_SPEED_DELAYS : SPEED_DELAYS)[speed - 1] >> in_hole;
+	run();
+	if (4 <= w->yhead && w->yhead < 4 + 10) {
+		w->speed = 9 - (w->yhead - 4);
+		w->speed -= 1 < w->xhead;
+	} else if (16 == w->yhead) {
+		return;
+	}
 
-		struct timespec next_frame;
-		next_frame.tv_sec = last_frame.tv_sec;
-		next_frame.tv_nsec = last_frame.tv_nsec + frame_duration * NSEC_PER_MSEC;
-		next_frame.tv_sec += NSEC_PER_SEC <= next_frame.tv_nsec;
-		next_frame.tv_nsec -= NSEC_PER_SEC <= next_frame.tv_nsec ? NSEC_PER_SEC : 0;
+	enter_speed_menu();
+}
 
-		struct timespec now;
-		clock_gettime(CLOCK_MONOTONIC, &now);
+static void
+wait_user(void)
+{
+	struct world *w = &world;
 
-		struct timespec timeout;
-		timeout.tv_sec = next_frame.tv_sec - now.tv_sec;
-		timeout.tv_nsec = next_frame.tv_nsec - now.tv_nsec;
-		timeout.tv_sec -= timeout.tv_nsec < 0;
-		timeout.tv_nsec += timeout.tv_nsec < 0 ? NSEC_PER_SEC : 0;
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGCONT);
+	sigaddset(&sigmask, SIGWINCH);
 
-		/* Missed frame. */
-		if (timeout.tv_sec < 0) {
-			timeout.tv_sec = 0;
-			timeout.tv_nsec = 0;
-		}
+	struct pollfd fds[3];
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = spectator_fd;
+	fds[1].events = POLLIN;
+	fds[2].fd = signal_fd;
+	fds[2].events = POLLIN;
+
+	draw(w);
 
-		int rc = ppoll(&fd, 1, paused ? NULL : &timeout, &sigmask);
+	for (;;) {
+		int rc = ppoll(fds, ARRAY_SIZE(fds), NULL, &sigmask);
 		if (rc < 0)
 			continue;
 
-		if (!rc) {
-			if (computer)
-				steer();
+		if (fds[1].revents)
+			accept_spectators(w);
 
-			if (!move_world()) {
-				yhead = -1;
-				xhead = -1;
-				return;
-			}
+		if (fds[2].revents && read_signals())
+			fdraw(w);
 
-			draw();
-			if (timeout.tv_sec || timeout.tv_nsec)
-				/* next_frame + frame_duration (likely) points to the future. */
-				last_frame = next_frame;
-			else
-				/* next_frame + frame_duration < now, catch up. */
-				clock_gettime(CLOCK_MONOTONIC, &last_frame);
+		if (!fds[0].revents)
 			continue;
-		}
 
-		if (~POLLIN & fd.revents)
+		if (fds[0].revents & ~POLLIN)
 			exit(EXIT_FAILURE);
 
 		char key;
-		if (1 != read(fd.fd, &key, sizeof key))
+		if (1 != read(fds[0].fd, &key, sizeof key))
 			continue;
-
-		if (mouse) switch (key) {
-		case 'A':
-			next_snake_dir = turn_right(snake_dir);
-			paused = 0;
+		if (' ' == key || 'p' == key)
 			break;
+	}
+}
 
-		case 'B':
-			next_snake_dir = turn_left(snake_dir);
-			paused = 0;
-			break;
+static void
+enter_maps_menu(int sel, int autoplay)
+{
+	struct world *w = &world;
 
-		case ' ':
-		case 'p':
-			paused ^= 1;
-			break;
-		} else switch (key) {
-		case '\033':
-		case '[':
-			/* Explicitly ignore. */
-			/* A-D is for \033[X arrow keys. */
-			break;
+	for (;;) {
+		fire(w);
+		plant_ctext(w, 1, "MAPS");
+		plant_snake(w, 4 + sel * 2, 2, RIGHT);
+		for (int i = 0; i < ARRAY_SIZE(MAPS); ++i)
+			plant_button(w, 4 + i * 2, 4, MAPS[i].name);
+		plant_button(w, H - 2, 2, "BACK");
+		paused = !autoplay;
 
-		case 'h':
-		case 'a':
-		case 'D':
-		case '4':
-			next_snake_dir = LEFT;
-			paused = 0;
-			break;
+		run();
+		if (4 <= w->yhead && w->yhead < H - 2) {
+			sel = (w->yhead - 4) / 2;
+			w->score = 0;
+			enter_map(&MAPS[sel]);
+			wait_user();
+		} else if (H - 2 == w->yhead) {
+			enter_welcome_menu();
+			return;
+		}
 
-		case 'j':
-		case 's':
-		case 'B':
-		case '5':
-		case '2':
-			next_snake_dir = DOWN;
-			paused = 0;
-			break;
+		autoplay = 0;
+	}
+}
 
-		case 'k':
-		case 'w':
-		case 'A':
-		case '8':
-			next_snake_dir = UP;
-			paused = 0;
-			break;
+static void
+enter_about_menu(void)
+{
+	struct world *w = &world;
+
+	fire(w);
+	plant_ctext(w, 1, "ABOUT");
+	plant_ctext(w, 4, "WRITTEN BY");
+	plant_button(w, 5, 4, "ZSUGABUBUS");
+	plant_snake(w, 5, 17, LEFT);
+	plant_ctext(w, 7, "LICENSE");
+	plant_ctext(w, 8, "UNLICENSE");
+	plant_ctext(w, 10, "BUGS");
+	plant_text(w, 11, 4, "GITHUB");
+	plant_text(w, 12, 6, "ZSUGABUBUS");
+	plant_text(w, 13, 13, "SNAKE");
+	paused = 1;
+	run();
+}
 
-		case 'l':
-		case 'd':
-		case 'C':
-		case '6':
-			next_snake_dir = RIGHT;
-			paused = 0;
-			break;
+static void
+enter_welcome_menu(void)
+{
+	struct world *w = &world;
 
-		case ' ':
-		case 'p':
-			paused ^= 1;
-			break;
+	enter_map(&MAPS[find_map("SLIT")]);
+
+	for (;;) {
+		fire(w);
+		plant_ctext(w, 1, "SNAKE");
+		if (mouse) {
+			plant_ctext(w, 5, "SCRL UP    TURN RIGHT");
+			plant_ctext(w, 6, "SCRL DOWN  TURN LEFT ");
+			plant_ctext(w, 7, "SPACE      PAUSE     ");
+		} else {
+			plant_ctext(w, 4, "H A    LEFT ");
+			plant_ctext(w, 5, "J S    DOWN ");
+			plant_ctext(w, 6, "K W    UP   ");
+			plant_ctext(w, 7, "L D    RIGHT");
+			plant_ctext(w, 8, "SPACE  PAUSE");
+		}
+		int width = 14;
+		int x = (W - width) / 2;
+		plant_button(w, 11, x, "PLAY");
+		plant_snake(w, 11, W - 1 - x, LEFT);
+		plant_button(w, 13, x + 2, "MAPS");
+		plant_button(w, 15, x + 4, "SPEED");
+		plant_button(w, 17, x + 6, "ABOUT");
+		plant_random(w, T_APPLE);
+
+		time_t now = time(NULL);
+		struct tm const *tm = localtime(&now);
+		int stars = 0;
+		if (20 <= tm->tm_hour)
+			stars = 3;
+		else if (tm->tm_hour <= 3)
+			stars = 5;
+		else if (tm->tm_hour <= 6)
+			stars = 9;
+		for (int i = 0; i < stars; ++i)
+			plant_random(w, T_STAR);
+
+		run();
+		if (11 == w->yhead) {
+			w->score = 0;
+			enter_map(&MAPS[0]);
+			wait_user();
+		} else if (13 == w->yhead) {
+			enter_maps_menu(0, 0);
+		} else if (15 == w->yhead) {
+			enter_speed_menu();
+		} else if (17 == w->yhead) {
+			enter_about_menu();
+		} else {
+			return;
 		}
 	}
 }
 
 static void
-plant_snake(int y, int x, enum direction d)
+handle_interrupt(int sig)
 {
-	ytail = yhead = y;
-	xtail = xhead = x;
-	next_snake_dir = snake_dir = d;
-	plant_yx(yhead, xhead, T_HEAD + snake_dir);
+	(void)sig;
+	exit(EXIT_FAILURE);
 }
 
-static void enter_random_map(void);
-
 static void
-marathon(void)
+restore_term(void)
 {
-	run();
-	if (0 <= yhead)
-		enter_random_map();
+	tcsetattr(STDOUT_FILENO, TCSANOW, &saved_termios);
+	fputs("\033[?25h", stdout);
+	fputs("\033[?1049l", stdout);
+	fflush(stdout);
 }
 
 static void
-enter_map_classic(void)
+save_term(void)
 {
-	fire();
-	plant_snake(12, 18, LEFT);
-	plant_random(T_APPLE);
-	marathon();
+	tcgetattr(STDOUT_FILENO, &saved_termios);
+	atexit(restore_term);
 }
 
+/* Ask terminal whether it supports synchronized output. */
 static void
-enter_map_around(void)
+query_sync_output(void)
 {
-	fire();
-	plant_yxh(0, 0, W, T_WALL);
-	plant_yxv(0, 0, H, T_WALL);
-	plant_yxv(0, W - 1, H, T_WALL);
-	plant_yxh(H - 1, 0, W, T_WALL);
-	plant_snake(H / 2, W / 2, rand() % 4);
-	plant_random(T_APPLE);
-	marathon();
+	sync_output = 0;
+	if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))
+		return;
+
+	/* DECRQM, then DA1 that every terminal answers. */
+	fputs("\033[?2026$p\033[c", stdout);
+	fflush(stdout);
+
+	char buf[256];
+	size_t n = 0;
+	struct pollfd fd;
+	fd.fd = STDIN_FILENO;
+	fd.events = POLLIN;
+	while (n < sizeof buf - 1 && 0 < poll(&fd, 1, 500)) {
+		ssize_t k = read(fd.fd, buf + n, sizeof buf - 1 - n);
+		if (k <= 0)
+			break;
+		n += k;
+		buf[n] = '\0';
+
+		/* DECRPM: 1 = set, 2 = reset. */
+		char const *p = strstr(buf, "\033[?2026;");
+		if (p && ('1' == p[8] || '2' == p[8]) && !strncmp(p + 9, "$y", 2))
+			sync_output = 1;
+
+		/* DA1 response: "\033[?...c". */
+		for (p = buf; (p = strstr(p, "\033[?")); ++p) {
+			size_t k = 3 + strspn(p + 3, "0123456789;");
+			if ('c' == p[k])
+				return;
+		}
+	}
 }
 
 static void
-enter_map_corners(void)
+prepare_term(void)
 {
-	int Py = 7;
+	struct termios new_termios = saved_termios;
+	new_termios.c_lflag &= ~(ICANON | ECHO);
+	tcsetattr(STDOUT_FILENO, TCSANOW, &new_termios);
 
-	fire();
-	/* Going clockwise starting from top left corner. */
-	plant_yxv(0, 0, 3, T_WALL);
-	plant_yx(0, 1, T_WALL);
-	plant_yx(0, W - 2, T_WALL);
-	plant_yxv(0, W - 1, 3, T_WALL);
-	plant_yxv(H - 3, W - 1, 3, T_WALL);
-	plant_yx(H - 1, W - 2, T_WALL);
-	plant_yx(H - 1, 1, T_WALL);
-	plant_yxv(H - 3, 0, 3, T_WALL);
-	/* Bars. */
-	int y = (H - Py) / 2 - 1, x = W / 4, xn = W - 2 * x;
-	plant_yxh(y, x, xn, T_WALL);
-	plant_yxh(H - 1 - y, x, xn, T_WALL);
-	plant_snake(H / 2 + rand() % 4 - 2, W / 2, rand() % 2 ? LEFT : RIGHT);
-	plant_random(T_APPLE);
-	marathon();
+	/* Hide cursor (DECTCEM). */
+	fputs("\033[?25l", stdout);
+	/* Use alt screen. */
+	fputs("\033[?1049h", stdout);
+	fflush(stdout);
+
+	if (sync_output < 0)
+		query_sync_output();
+}
+
+/*
+ * Drain terminal signals and prepare terminal again if any came, in which
+ * case screen has to be redrawn. A window being resized sends a lot of
+ * them.
+ */
+static int
+read_signals(void)
+{
+	struct signalfd_siginfo info;
+	int any = 0;
+	while (sizeof info == read(signal_fd, &info, sizeof info))
+		any = 1;
+	if (any)
+		prepare_term();
+	return any;
+}
+
+/*
+ * Versus mode: Two processes, each with its own snake, play on the same map
+ * connected with a unix socket. Whoever crashes loses, whoever disappears
+ * in a hole wins.
+ *
+ * Both sides simulate the same game from the inputs of both players. Own
+ * input is applied at once, input of the other player is guessed to be
+ * nothing until it arrives. What is shown is replayed every frame from the
+ * last state both inputs are known for, so a wrong guess is rolled back at
+ * the next frame.
+ */
+
+/* Snake of the other player. Same as in world so they can be swapped. */
+struct rival {
+	enum direction snake_dir, next_snake_dir;
+	int snake_growth;
+	int score;
+	int ytail, xtail;
+	int yhead, xhead;
+	short body[H * W];
+	unsigned body_index[H * W];
+	unsigned body_tail, body_head;
+};
+
+enum {
+	/* Ticks played ahead of what both inputs are known for. */
+	VERSUS_WINDOW = 64,
+	/* Other player may be a window ahead of own inputs, which may be a
+	 * window ahead of what is confirmed. */
+	VERSUS_RING = 2 * VERSUS_WINDOW,
+	NO_INPUT = 4,
+};
+
+enum versus_result {
+	PLAYING,
+	HOST_WINS,
+	GUEST_WINS,
+	DRAW,
+};
+
+#define VERSUS_MAGIC "snakevs\3"
+
+struct versus_hello {
+	char magic[8];
+	unsigned seed;
+	int map;
+	int speed;
+	int max_bugs;
+	/* Host's, so a computer does not tick faster than a human. */
+	int frame_msec;
+};
+
+struct versus_input {
+	unsigned tick;
+	signed char input;
+};
+
+static struct {
+	char const *path;
+	/* Delay own messages by this much to test lag. */
+	int delay_msec;
+	int listen_fd;
+	int fd;
+	/* 0 for host, 1 for guest. */
+	int me;
+	int frame_msec;
+	/* Host's snake is in world, guest's in rival. */
+	struct world world;
+	struct rival rival;
+	enum versus_result result;
+	/* Number of ticks both inputs are known for. */
+	unsigned confirmed;
+	/* Host and guest inputs by tick modulo window. */
+	signed char inputs[2][VERSUS_RING];
+	unsigned ninputs[2];
+	/* Messages held back by delay_msec. */
+	struct {
+		struct timespec due;
+		struct versus_input msg;
+	} outbox[2 * VERSUS_WINDOW];
+	int noutbox;
+} versus = {
+	.listen_fd = -1,
+	.fd = -1,
+};
+
+static void
+swap_rival(struct world *w, struct rival *r)
+{
+#define SWAP(field) do { \
+	char tmp[sizeof r->field]; \
+	memcpy(tmp, &r->field, sizeof tmp); \
+	memcpy(&r->field, &w->field, sizeof tmp); \
+	memcpy(&w->field, tmp, sizeof tmp); \
+} while (0)
+	SWAP(snake_dir);
+	SWAP(next_snake_dir);
+	SWAP(snake_growth);
+	SWAP(score);
+	SWAP(ytail);
+	SWAP(xtail);
+	SWAP(yhead);
+	SWAP(xhead);
+	SWAP(body);
+	SWAP(body_index);
+	SWAP(body_tail);
+	SWAP(body_head);
+#undef SWAP
 }
 
+/* Plant map with host's snake, then guest's opposite to it. */
 static void
-enter_map_whirpool(void)
+plant_versus(struct world *w, struct rival *r, struct map const *map)
 {
-	int Pc = 1;
-	int Px = 3;
+	w->score = 0;
+	fire(w);
+	map->plant(w);
+
+	swap_rival(w, r);
+	int pos = (H - 1 - r->yhead) * W + (W - 1 - r->xhead);
+	if (T_GROUND != w->jungle[pos])
+		pos = plant_random(w, T_GROUND);
+	w->score = 0;
+	/* As fire() leaves it for the host. */
+	w->snake_growth = 1;
+	plant_snake(w, pos / W, pos % W, opposite(r->snake_dir));
+	swap_rival(w, r);
+
+	plant_random(w, T_APPLE);
+}
+
+/*
+ * Both tails go before either head moves, so neither snake moves first.
+ * Heads meeting is a draw, so is both snakes dying or both going in holes.
+ */
+static enum versus_result
+versus_step(struct world *w, struct rival *r, int host_input, int guest_input)
+{
+	int from[2], to[2], alive[2], gone[2];
+
+	for (int k = 0; k < 2; ++k) {
+		if (k)
+			swap_rival(w, r);
+		int input = k ? guest_input : host_input;
+		if (NO_INPUT != input)
+			w->next_snake_dir = input;
+		begin_move(w);
+		from[k] = w->yhead * W + w->xhead;
+		to[k] = next_head(w);
+		if (k)
+			swap_rival(w, r);
+	}
+
+	/* Into the same cell, or through each other. */
+	if ((0 <= to[0] && to[0] == to[1]) ||
+	    (to[0] == from[1] && to[1] == from[0]))
+	{
+		plant(w, to[0], T_HIT);
+		plant(w, to[1], T_HIT);
+		return DRAW;
+	}
+
+	for (int k = 0; k < 2; ++k) {
+		if (k)
+			swap_rival(w, r);
+		alive[k] = finish_move(w);
+		gone[k] = alive[k] && T_GROUND == w->jungle[w->yhead * W + w->xhead];
+		if (k)
+			swap_rival(w, r);
+	}
 
-	fire();
-	int yn = (H - Pc) / 2, xn = (W - Pc) / 2;
-	int yoff = yn - Px - 1, xoff = xn + Px + 1;
-	plant_yxh(yoff, 0, xn, T_WALL);
-	plant_yxh(H - 1 - yoff, W - xn, xn, T_WALL);
-	plant_yxv(0, xoff, yn, T_WALL);
-	plant_yxv(H - yn, W - 1 - xoff, yn, T_WALL);
-	plant_snake(H / 2, W / 2, rand() % 4);
-	plant_random(T_APPLE);
-	marathon();
+	int host_wins = gone[0] || !alive[1];
+	int guest_wins = gone[1] || !alive[0];
+	if (host_wins && guest_wins)
+		return DRAW;
+	if (host_wins)
+		return HOST_WINS;
+	if (guest_wins)
+		return GUEST_WINS;
+
+	move_food(w);
+	return PLAYING;
 }
 
-static void
-enter_map_cross(void)
+static int
+versus_input(int player, unsigned tick)
 {
-	fire();
-	plant_yxh(H / 2, W / 2 - W / 4, W / 2 | 1, T_WALL);
-	plant_yxv(H / 2 - H / 4, W / 2, H / 2 | 1, T_WALL);
-	int y = rand() % 2 ? H - 1 - H / 8 : H / 8;
-	int x = rand() % 2 ? W - 1 - W / 8 : W / 8;
-	plant_snake(y, x, rand() % 4);
-	plant_random(T_APPLE);
-	marathon();
+	return tick < versus.ninputs[player]
+		? versus.inputs[player][tick % VERSUS_RING]
+		: NO_INPUT;
 }
 
-static void
-enter_map_four(void)
+/*
+ * Replay from confirmed state as far as own inputs go, into own view of
+ * world and snake of the other player.
+ */
+static enum versus_result
+predict_versus(struct world *w, struct rival *r)
 {
-	fire();
-	plant_yxh(H / 2, 0, W, T_WALL);
-	plant_yxv(0, W / 2, H, T_WALL);
-	int y = H / 4 + (rand() % 2 ? H / 2 : 0);
-	int x = W / 4 + (rand() % 2 ? W / 2 : 0);
-	enum direction d = rand() % 2
-		? (y < H / 2 ? UP : DOWN)
-		: (x < W / 2 ? LEFT : RIGHT);
-	plant_snake(y, x, d);
-	plant_random(T_APPLE);
-	marathon();
+	*r = versus.rival;
+	enum versus_result result = versus.result;
+	*w = versus.world;
+	for (unsigned t = versus.confirmed; !result && t < versus.ninputs[versus.me]; ++t)
+		result = versus_step(w, r, versus_input(0, t), versus_input(1, t));
+	if (versus.me)
+		swap_rival(w, r);
+	return result;
 }
 
 static void
-enter_map_slit(void)
+show_rival(struct rival const *r)
 {
-	fire();
-	plant_yxh(0, 0, W, T_WALL);
-	plant_yxv(0, 0, H, T_WALL);
-	plant_yxv(0, W - 1, H, T_WALL);
-	plant_yxh(H - 1, 0, W, T_WALL);
-	enum direction d;
-	int y, x;
-	if (rand() % 2) {
-		plant_yxv(0, W / 2, H, T_WALL);
-		plant_yx(H / 2 - 1, W / 2, T_GROUND);
-		plant_yx(H / 2 + 1, W / 2, T_GROUND);
-		d = rand() % 2 ? LEFT : RIGHT;
-		y = H / 2 + (rand() % 2 ? 1 : -1);
-		x = W / 4 + (RIGHT == d ? 0 : W / 2);
-	} else {
-		plant_yxh(H / 2, 0, W, T_WALL);
-		plant_yx(H / 2, W / 2 - 1, T_GROUND);
-		plant_yx(H / 2, W / 2 + 1, T_GROUND);
-		d = rand() % 2 ? UP : DOWN;
-		y = H / 4 + (DOWN == d ? 0 : H / 2);
-		x = W / 2 + (rand() % 2 ? 1 : -1);
+	uint64_t at[ARRAY_SIZE(rival_at)] = { 0 };
+	for (unsigned k = r->body_tail; k != r->body_head; ++k) {
+		int pos = r->body[k % (H * W)];
+		at[pos / 64] |= (uint64_t)1 << pos % 64;
 	}
-	plant_snake(y, x, d);
-	plant_random(T_APPLE);
-	marathon();
+	set_rival_at(at);
 }
 
-static void enter_random_map(void);
-
-static struct map const MAPS[] = {
-	{ "RANDOM", enter_random_map },
-	{ "CLASSIC", enter_map_classic },
-	{ "AROUND", enter_map_around },
-	{ "CORNERS", enter_map_corners },
-	{ "CROSS", enter_map_cross },
-	{ "WHIRPOOL", enter_map_whirpool },
-	{ "FOUR", enter_map_four },
-	{ "SLIT", enter_map_slit },
-};
+/*
+ * Send own inputs that have been held back long enough, or all of them.
+ * Return -1 if the other player is gone.
+ */
+static int
+flush_versus(int all)
+{
+	int n = 0, ret = 0;
+	for (; n < versus.noutbox &&
+	       (all || expired(&versus.outbox[n].due) || ARRAY_SIZE(versus.outbox) == versus.noutbox);
+	     ++n)
+		if (sizeof versus.outbox[n].msg != send(versus.fd, &versus.outbox[n].msg,
+					sizeof versus.outbox[n].msg, MSG_NOSIGNAL))
+		{
+			ret = -1;
+			break;
+		}
+	versus.noutbox -= n;
+	memmove(versus.outbox, versus.outbox + n, versus.noutbox * sizeof *versus.outbox);
+	return ret;
+}
 
 static void
-enter_random_map(void)
+confirm_versus(void)
 {
-	MAPS[rand() % ARRAY_SIZE(MAPS)].enter();
+	while (!versus.result &&
+	       versus.confirmed < versus.ninputs[0] &&
+	       versus.confirmed < versus.ninputs[1])
+	{
+		versus.result = versus_step(&versus.world, &versus.rival,
+				versus_input(0, versus.confirmed),
+				versus_input(1, versus.confirmed));
+		++versus.confirmed;
+	}
 }
 
-static void
-plant_button(int y, int x, char const *text)
+/* Take inputs of the other player. Return -1 if it is gone. */
+static int
+receive_versus(void)
 {
-	plant_yx(y, x, T_HOLE);
-	plant_text(y, x + 2, text);
+	int other = !versus.me;
+	struct versus_input msg;
+	ssize_t n;
+	while (0 < (n = recv(versus.fd, &msg, sizeof msg, MSG_DONTWAIT))) {
+		/* It would overwrite an input not yet played. */
+		if (sizeof msg != n || versus.ninputs[other] != msg.tick ||
+		    versus.confirmed + VERSUS_RING <= msg.tick ||
+		    !(0 <= msg.input && msg.input <= NO_INPUT))
+			return -1;
+		versus.inputs[other][msg.tick % VERSUS_RING] = msg.input;
+		++versus.ninputs[other];
+		confirm_versus();
+	}
+	if (!n || (EAGAIN != errno && EWOULDBLOCK != errno))
+		return -1;
+	return 0;
 }
 
-static void
-enter_welcome_menu(void);
+/* Return -1 if the other player is gone. */
+static int
+add_input(int input)
+{
+	unsigned tick = versus.ninputs[versus.me]++;
+	versus.inputs[versus.me][tick % VERSUS_RING] = input;
+
+	struct timespec due;
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	due.tv_nsec += versus.delay_msec * 1000000L;
+	due.tv_sec += due.tv_nsec / 1000000000L;
+	due.tv_nsec %= 1000000000L;
+
+	versus.outbox[versus.noutbox].due = due;
+	versus.outbox[versus.noutbox].msg.tick = tick;
+	versus.outbox[versus.noutbox].msg.input = input;
+	++versus.noutbox;
+	confirm_versus();
+	return flush_versus(0);
+}
 
-static void
-enter_speed_menu(void)
+/*
+ * Join game waiting on socket, or start waiting there if there is none.
+ * Guest gets map and everything else from host.
+ */
+static int
+open_versus(int *map)
 {
-	fire();
-	plant_ctext(1, "SPEED");
-	plant_text(3, 0, "SET");
-	plant_text(3, W - 6, "SLOWER");
-	for (int i = 1; i <= 9; ++i) {
-		plant_yxh(3 + i, (W - 9) / 2, 9 - i + 1, T_STAR);
-		plant_yx(3 + i, 0, T_HOLE);
-		plant_yx(3 + i, W - i, i == 9 ? T_WALL : T_HOLE);
+	char const *path = versus.path;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (sizeof addr.sun_path <= strlen(path)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(ENAMETOOLONG));
+		return -1;
 	}
-	plant_snake(4 + (9 - speed), 1, RIGHT);
-	int x = W - 9;
-	plant_yx(15, x - 1, T_EGG);
-	plant_yxv(15, x, 4, T_WALL);
-	plant_yx(16, x - 1, T_WALL);
-	plant_yx(16, x + 1, T_SNAIL);
-	plant_yx(17, x - 1, T_BEETLE);
-	plant_yxh(17, x, 3, T_WALL);
-	plant_yx(17, x + 3, T_EGG);
-	plant_text(15, 1, "BACK");
-	plant_yxh(16, 1, 4, T_HOLE);
-	plant_yx(16, 0, T_WALL);
-	plant_random(T_APPLE);
-
-	run();
-	if (4 <= yhead && yhead < 4 + 10) {
-		speed = 9 - (yhead - 4);
-		speed -= 1 < xhead;
-	} else if (16 == yhead) {
-		return;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto fail;
+
+	if (!connect(fd, (struct sockaddr *)&addr, sizeof addr)) {
+		struct versus_hello hello;
+		if (sizeof hello != recv(fd, &hello, sizeof hello, 0) ||
+		    memcmp(hello.magic, VERSUS_MAGIC, sizeof hello.magic) ||
+		    !(0 <= hello.map && hello.map < ARRAY_SIZE(MAPS)) ||
+		    !(1 <= hello.speed && hello.speed <= 9) ||
+		    !(0 <= hello.max_bugs && hello.max_bugs <= MAX_BUGS) ||
+		    !(0 < hello.frame_msec && hello.frame_msec <= 1000))
+		{
+			fprintf(stderr, "%s: Bad greeting\n", path);
+			return -1;
+		}
+		versus.fd = fd;
+		versus.me = 1;
+		versus.world.seed = hello.seed;
+		world.speed = hello.speed;
+		world.max_bugs = hello.max_bugs;
+		versus.frame_msec = hello.frame_msec;
+		*map = hello.map;
+		return 0;
 	}
+	if (ECONNREFUSED != errno && ENOENT != errno)
+		goto fail;
+
+	/* Nobody is waiting. Remove stale socket. */
+	struct stat st;
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+	    listen(fd, 1) < 0)
+		goto fail;
+	versus.listen_fd = fd;
+	versus.me = 0;
+	versus.world.seed = world.seed;
+	versus.frame_msec = (computer ? COMPUTER_SPEED_DELAYS : SPEED_DELAYS)[world.speed - 1];
+	if (*map < 0)
+		*map = 0;
+	return 0;
 
-	enter_speed_menu();
+fail:
+	fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	return -1;
 }
 
-static void
-wait_user(void)
+/* Host waits for the other player to come. */
+static int
+accept_versus(int map)
 {
-	sigset_t unblock_all;
-	sigemptyset(&unblock_all);
-
-	struct pollfd fd;
-	fd.fd = STDIN_FILENO;
-	fd.events = POLLIN;
+	struct world *w = &world;
 
-	draw();
+	fire(w);
+	plant_ctext(w, H / 2, "WAITING");
+	fdraw(w);
 
-	for (;;) {
-		int rc = ppoll(&fd, 1, NULL, &unblock_all);
-		if (rc < 0)
-			continue;
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGCONT);
+	sigaddset(&sigmask, SIGWINCH);
 
-		if (fd.revents & ~POLLIN)
-			exit(EXIT_FAILURE);
+	struct pollfd fds[2];
+	fds[0].fd = versus.listen_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = signal_fd;
+	fds[1].events = POLLIN;
 
-		char key;
-		if (1 != read(fd.fd, &key, sizeof key))
+	for (;;) {
+		/* revents are not touched when interrupted. */
+		if (ppoll(fds, ARRAY_SIZE(fds), NULL, &sigmask) < 0)
 			continue;
-		if (' ' == key || 'p' == key)
+		if (fds[1].revents && read_signals())
+			fdraw(w);
+		if (fds[0].revents)
 			break;
 	}
+	versus.fd = accept4(versus.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	close(versus.listen_fd);
+	unlink(versus.path);
+	if (versus.fd < 0)
+		return -1;
+
+	struct versus_hello hello = {
+		.seed = versus.world.seed,
+		.map = map,
+		.speed = world.speed,
+		.max_bugs = world.max_bugs,
+		.frame_msec = versus.frame_msec,
+	};
+	memcpy(hello.magic, VERSUS_MAGIC, sizeof hello.magic);
+	return sizeof hello == send(versus.fd, &hello, sizeof hello, MSG_NOSIGNAL) ? 0 : -1;
 }
 
 static void
-enter_maps_menu(int sel, int autoplay)
+play_versus(int map)
 {
-	for (;;) {
-		fire();
-		plant_ctext(1, "MAPS");
-		plant_snake(4 + sel * 2, 2, RIGHT);
-		for (int i = 0; i < ARRAY_SIZE(MAPS); ++i)
-			plant_button(4 + i * 2, 4, MAPS[i].name);
-		plant_button(H - 2, 2, "BACK");
-		paused = !autoplay;
+	struct world *w = &world;
 
-		run();
-		if (4 <= yhead && yhead < H - 2) {
-			sel = (yhead - 4) / 2;
-			score = 0;
-			MAPS[sel].enter();
-			wait_user();
-		} else if (H - 2 == yhead) {
-			enter_welcome_menu();
-			return;
+	static long const NSEC_PER_MSEC = 1000000;
+	static long const NSEC_PER_SEC = NSEC_PER_MSEC * 1000;
+
+	if (!versus.me && accept_versus(map) < 0)
+		return;
+
+	plant_versus(&versus.world, &versus.rival, &MAPS[map]);
+	versus.world.speed = world.speed;
+	versus.world.max_bugs = world.max_bugs;
+
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGCONT);
+	sigaddset(&sigmask, SIGWINCH);
+
+	struct pollfd fds[3];
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = versus.fd;
+	fds[1].events = POLLIN;
+	fds[2].fd = signal_fd;
+	fds[2].events = POLLIN;
+
+	int frame_duration = versus.frame_msec;
+	int input = NO_INPUT;
+	int gone = 0;
+	struct rival r;
+
+	predict_versus(w, &r);
+	show_rival(&r);
+	fdraw(w);
+	struct timespec next_frame;
+	clock_gettime(CLOCK_MONOTONIC, &next_frame);
+
+	while (!versus.result && !gone) {
+		struct timespec wake = next_frame;
+		if (versus.noutbox &&
+		    (versus.outbox[0].due.tv_sec < wake.tv_sec ||
+		     (versus.outbox[0].due.tv_sec == wake.tv_sec &&
+		      versus.outbox[0].due.tv_nsec < wake.tv_nsec)))
+			wake = versus.outbox[0].due;
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		struct timespec timeout;
+		timeout.tv_sec = wake.tv_sec - now.tv_sec;
+		timeout.tv_nsec = wake.tv_nsec - now.tv_nsec;
+		timeout.tv_sec -= timeout.tv_nsec < 0;
+		timeout.tv_nsec += timeout.tv_nsec < 0 ? NSEC_PER_SEC : 0;
+		if (timeout.tv_sec < 0) {
+			timeout.tv_sec = 0;
+			timeout.tv_nsec = 0;
 		}
 
-		autoplay = 0;
-	}
-}
+		if (ppoll(fds, ARRAY_SIZE(fds), &timeout, &sigmask) < 0)
+			continue;
 
-static void
-enter_about_menu(void)
-{
-	fire();
-	plant_ctext(1, "ABOUT");
-	plant_ctext(4, "WRITTEN BY");
-	plant_button(5, 4, "ZSUGABUBUS");
-	plant_snake(5, 17, LEFT);
-	plant_ctext(7, "LICENSE");
-	plant_ctext(8, "UNLICENSE");
-	plant_ctext(10, "BUGS");
-	plant_text(11, 4, "GITHUB");
-	plant_text(12, 6, "ZSUGABUBUS");
-	plant_text(13, 13, "SNAKE");
-	paused = 1;
-	run();
-}
+		if (fds[2].revents && read_signals())
+			shown_valid = 0;
 
-static void
-enter_welcome_menu(void)
-{
-	enter_map_slit();
+		if (fds[1].revents && receive_versus() < 0)
+			gone = 1;
 
-	for (;;) {
-		fire();
-		plant_ctext(1, "SNAKE");
-		if (mouse) {
-			plant_ctext(5, "SCRL UP    TURN RIGHT");
-			plant_ctext(6, "SCRL DOWN  TURN LEFT ");
-			plant_ctext(7, "SPACE      PAUSE     ");
-		} else {
-			plant_ctext(4, "H A    LEFT ");
-			plant_ctext(5, "J S    DOWN ");
-			plant_ctext(6, "K W    UP   ");
-			plant_ctext(7, "L D    RIGHT");
-			plant_ctext(8, "SPACE  PAUSE");
+		char key;
+		if (fds[0].revents && 1 == read(STDIN_FILENO, &key, sizeof key)) {
+			int d = key_direction(key);
+			if (0 <= d)
+				input = d;
+			else if ('q' == key)
+				return;
 		}
-		int width = 14;
-		int x = (W - width) / 2;
-		plant_button(11, x, "PLAY");
-		plant_snake(11, W - 1 - x, LEFT);
-		plant_button(13, x + 2, "MAPS");
-		plant_button(15, x + 4, "SPEED");
-		plant_button(17, x + 6, "ABOUT");
-		plant_random(T_APPLE);
 
-		time_t now = time(NULL);
-		struct tm const *tm = localtime(&now);
-		int stars = 0;
-		if (20 <= tm->tm_hour)
-			stars = 3;
-		else if (tm->tm_hour <= 3)
-			stars = 5;
-		else if (tm->tm_hour <= 6)
-			stars = 9;
-		for (int i = 0; i < stars; ++i)
-			plant_random(T_STAR);
+		if (flush_versus(0) < 0)
+			gone = 1;
 
-		run();
-		if (11 == yhead) {
-			score = 0;
-			enter_random_map();
-			wait_user();
-		} else if (13 == yhead) {
-			enter_maps_menu(0, 0);
-		} else if (15 == yhead) {
-			enter_speed_menu();
-		} else if (17 == yhead) {
-			enter_about_menu();
-		} else {
-			return;
+		if (!expired(&next_frame))
+			continue;
+
+		if (computer && NO_INPUT == input) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_nsec += frame_duration * NSEC_PER_MSEC / 2;
+			deadline.tv_sec += deadline.tv_nsec / NSEC_PER_SEC;
+			deadline.tv_nsec %= NSEC_PER_SEC;
+			computer->steer(w, &deadline);
+			if (w->next_snake_dir != w->snake_dir)
+				input = w->next_snake_dir;
+		}
+
+		/* Wait for the other one if it lags too much behind. */
+		if (versus.ninputs[versus.me] - versus.confirmed < VERSUS_WINDOW) {
+			if (add_input(input) < 0)
+				gone = 1;
+			input = NO_INPUT;
 		}
+
+		next_frame.tv_nsec += frame_duration * NSEC_PER_MSEC;
+		next_frame.tv_sec += next_frame.tv_nsec / NSEC_PER_SEC;
+		next_frame.tv_nsec %= NSEC_PER_SEC;
+		if (expired(&next_frame))
+			clock_gettime(CLOCK_MONOTONIC, &next_frame);
+
+		predict_versus(w, &r);
+		show_rival(&r);
+		/* Anything may have changed since last frame. */
+		w->partially_damaged = 0;
+		draw(w);
 	}
-}
 
-static void
-handle_interrupt(int sig)
-{
-	(void)sig;
-	exit(EXIT_FAILURE);
-}
+	/* The other one still needs them to see the end. */
+	if (!gone && flush_versus(1) < 0)
+		gone = 1;
 
-static void
-restore_term(void)
-{
-	tcsetattr(STDOUT_FILENO, TCSANOW, &saved_termios);
-	fputs("\033[?25h", stdout);
-	fputs("\033[?1049l", stdout);
-	fflush(stdout);
+	if (gone) {
+		plant_ctext(w, H / 2, "PLAYER LEFT");
+	} else {
+		predict_versus(w, &r);
+		show_rival(&r);
+		int won = (HOST_WINS == versus.result) == !versus.me;
+		plant_ctext(w, H / 2,
+				DRAW == versus.result ? "DRAW" :
+				won ? "YOU WIN" : "YOU LOSE");
+	}
+	w->partially_damaged = 0;
+	wait_user();
 }
 
 static void
-save_term(void)
+save_snapshot(void)
 {
-	tcgetattr(STDOUT_FILENO, &saved_termios);
-	atexit(restore_term);
-}
+	if (!world.playing)
+		return;
 
-static void
-prepare_term(void)
-{
-	struct termios new_termios = saved_termios;
-	new_termios.c_lflag &= ~(ICANON | ECHO);
-	tcsetattr(STDOUT_FILENO, TCSANOW, &new_termios);
+	struct snapshot snap;
+	memcpy(snap.magic, SNAPSHOT_MAGIC, sizeof snap.magic);
+	snap.size = sizeof snap.world;
+	snap.world = world;
 
-	/* Hide cursor (DECTCEM). */
-	fputs("\033[?25l", stdout);
-	/* Use alt screen. */
-	fputs("\033[?1049h", stdout);
-	fflush(stdout);
+	int fd = open(snapshot_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return;
+	if (sizeof snap != write(fd, &snap, sizeof snap))
+		unlink(snapshot_path);
+	close(fd);
 }
 
-static void
-handle_continue(int sig)
+static int
+load_snapshot(void)
 {
-	(void)sig;
-	prepare_term();
-	partially_damaged = 0;
-	draw();
+	int fd = open(snapshot_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	struct stat st;
+	void *p = MAP_FAILED;
+	if (!fstat(fd, &st) && sizeof(struct snapshot) == st.st_size)
+		p = mmap(NULL, sizeof(struct snapshot), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == p)
+		return 0;
+
+	struct snapshot const *snap = p;
+	int ok =
+		!memcmp(snap->magic, SNAPSHOT_MAGIC, sizeof snap->magic) &&
+		sizeof snap->world == snap->size;
+	if (ok)
+		memcpy(&world, &snap->world, sizeof world);
+	munmap(p, sizeof *snap);
+
+	/* Game continues from here. It will be saved again if interrupted. */
+	if (ok)
+		unlink(snapshot_path);
+	return ok;
 }
 
 static void
@@ -1518,6 +5134,15 @@ print_m_help(FILE *stream)
 		fprintf(stream, "  %s\n", MAPS[i].name);
 }
 
+static void
+print_a_help(FILE *stream)
+{
+	fprintf(stream, "Available engines:\n");
+	for (int i = 0; i < ARRAY_SIZE(AIS); ++i)
+		fprintf(stream, "  %s\n", AIS[i].name);
+	fprintf(stream, "  exec:CMD\n");
+}
+
 static void
 print_s_help(FILE *stream)
 {
@@ -1528,7 +5153,7 @@ print_s_help(FILE *stream)
 			s0 = " (slowest)";
 		else if (9 == i)
 			s0 = " (fastest)";
-		if (speed == i)
+		if (world.speed == i)
 			s1 = " (current)";
 		fprintf(stream, "  %-6d%3d/%3d ms%s%s\n",
 				i, SPEED_DELAYS[i - 1], COMPUTER_SPEED_DELAYS[i - 1], s0, s1);
@@ -1539,30 +5164,89 @@ static void
 print_t_help(FILE *stream)
 {
 	fprintf(stream, "Available themes:\n");
-	fprintf(stream, "  ascii\n");
-	fprintf(stream, "  ascii-block\n");
-	fprintf(stream, "  unicode\n");
+	for (int i = 0; i < ARRAY_SIZE(THEMES); ++i)
+		fprintf(stream, "  %s\n", THEMES[i].name);
+	fprintf(stream, "  FILE\n");
 }
 
 int
 main(int argc, char *argv[])
 {
-	srand(time(NULL));
+	world.seed = time(NULL);
+#ifdef INSTRUMENT
+	atexit(dump_probes);
+#endif
 	setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+	setlocale(LC_CTYPE, "");
+	compile_theme(&theme, UNICODE_ARTS);
 	sigset_t block_all;
 	sigfillset(&block_all);
 	pthread_sigmask(SIG_SETMASK, &block_all, NULL);
 	signal(SIGINT, handle_interrupt);
 	signal(SIGTERM, handle_interrupt);
 	signal(SIGQUIT, handle_interrupt);
-	signal(SIGCONT, handle_continue);
-	signal(SIGWINCH, handle_continue);
+	sigset_t terminal_signals;
+	sigemptyset(&terminal_signals);
+	sigaddset(&terminal_signals, SIGCONT);
+	sigaddset(&terminal_signals, SIGWINCH);
+	signal_fd = signalfd(-1, &terminal_signals, SFD_NONBLOCK | SFD_CLOEXEC);
 
 	int map = -1;
+	int tuning = 0;
+	int ngames = 0;
+	int nframes = 0;
+	char const *baseline_path = NULL;
 
-	for (int opt; 0 < (opt = getopt(argc, argv, "am:Ms:t:h"));) switch (opt) {
+	for (int opt; 0 < (opt = getopt(argc, argv, "a::b:B:l:L:m:Mn:P:R:s:t:TV:X:h"));) switch (opt) {
 	case 'a':
-		computer = 1;
+		/* Optional argument may be separated. */
+		if (!optarg && optind < argc && '-' != *argv[optind])
+			optarg = argv[optind++];
+		if (!optarg) {
+			computer = &AIS[0];
+			break;
+		}
+		if (!strcmp(optarg, "help")) {
+			print_a_help(stdout);
+			return EXIT_SUCCESS;
+		}
+		for (int i = 0; i < ARRAY_SIZE(AIS); ++i)
+			if (!strcmp(optarg, AIS[i].name))
+				computer = &AIS[i];
+		if (!strncmp(optarg, "exec:", 5) && optarg[5]) {
+			bot.command = optarg + 5;
+			computer = &EXEC_AI;
+		}
+		if (!computer) {
+			fprintf(stderr, USAGE);
+			print_a_help(stderr);
+			return EXIT_FAILURE;
+		}
+		break;
+
+	case 'b':
+		if ((ngames = atoi(optarg)) <= 0) {
+			fprintf(stderr, USAGE);
+			return EXIT_FAILURE;
+		}
+		break;
+
+	case 'B':
+		if ((nframes = atoi(optarg)) <= 0) {
+			fprintf(stderr, USAGE);
+			return EXIT_FAILURE;
+		}
+		break;
+
+	case 'l':
+		if ((versus.delay_msec = atoi(optarg)) < 0) {
+			fprintf(stderr, USAGE);
+			return EXIT_FAILURE;
+		}
+		break;
+
+	case 'L':
+		snapshot_path = optarg;
 		break;
 
 	case 'm':
@@ -1570,20 +5254,38 @@ main(int argc, char *argv[])
 			print_m_help(stdout);
 			return EXIT_SUCCESS;
 		}
-		for (int i = 0; i < ARRAY_SIZE(MAPS); ++i)
-			if (!strcmp(optarg, MAPS[i].name))
-				map = i;
-		if (map < 0) {
+		if (0 <= (map = find_map(optarg)))
+			break;
+		if (access(optarg, F_OK)) {
 			fprintf(stderr, USAGE);
 			print_m_help(stderr);
 			return EXIT_FAILURE;
 		}
+		if (load_map(optarg) < 0)
+			return EXIT_FAILURE;
 		break;
 
 	case 'M':
 		mouse = 1;
 		break;
 
+	case 'n':
+		world.max_bugs = atoi(optarg);
+		if (!(0 <= world.max_bugs && world.max_bugs <= MAX_BUGS)) {
+			fprintf(stderr, USAGE);
+			return EXIT_FAILURE;
+		}
+		break;
+
+	case 'P':
+		if (open_export(optarg) < 0)
+			return EXIT_FAILURE;
+		break;
+
+	case 'R':
+		baseline_path = optarg;
+		break;
+
 	case 's':
 		if (!strcmp(optarg, "help")) {
 			print_s_help(stdout);
@@ -1596,7 +5298,7 @@ main(int argc, char *argv[])
 			print_s_help(stderr);
 			return EXIT_FAILURE;
 		}
-		speed = n;
+		world.speed = n;
 	}
 		break;
 
@@ -1605,17 +5307,31 @@ main(int argc, char *argv[])
 			print_t_help(stdout);
 			return EXIT_SUCCESS;
 		}
-		if (!strcmp(optarg, "ascii")) {
-			ARTS = ASCII_ARTS;
-		} else if (!strcmp(optarg, "ascii-block")) {
-			ARTS = ASCII_BLOCK_ARTS;
-		} else if (!strcmp(optarg, "unicode")) {
-			ARTS = UNICODE_ARTS;
-		} else {
+	{
+		int i = find_theme(optarg);
+		if (0 <= i) {
+			compile_theme(&theme, THEMES[i].arts);
+		} else if (access(optarg, F_OK)) {
 			fprintf(stderr, USAGE);
 			print_t_help(stderr);
 			return EXIT_FAILURE;
+		} else if (load_theme(&theme, optarg) < 0) {
+			return EXIT_FAILURE;
 		}
+	}
+		break;
+
+	case 'T':
+		tuning = 1;
+		break;
+
+	case 'V':
+		versus.path = optarg;
+		break;
+
+	case 'X':
+		if (listen_spectators(optarg) < 0)
+			return EXIT_FAILURE;
 		break;
 
 	case 'h':
@@ -1630,9 +5346,66 @@ main(int argc, char *argv[])
 		abort();
 	}
 
+	/*
+	 * Games played by -b and -V take any engine. Tuning searches planner
+	 * parameters and -B records frames of the planner, so those take none
+	 * but the default.
+	 */
+	if ((tuning || nframes) && computer && &AIS[0] != computer) {
+		fprintf(stderr, "%s: Only the default ai can be %s\n",
+				computer->name, tuning ? "tuned" : "recorded for -B");
+		return EXIT_FAILURE;
+	}
+
+	if (bot.command && start_bot() < 0)
+		return EXIT_FAILURE;
+
+	if (tuning || ngames || nframes) {
+		/* RANDOM means all of them. */
+		struct map const *maps = MAPS + 1;
+		int nmaps = ARRAY_SIZE(MAPS) - 1;
+		if (custom_map.plant)
+			maps = &custom_map, nmaps = 1;
+		else if (0 < map)
+			maps = &MAPS[map], nmaps = 1;
+		if (tuning)
+			return tune(maps, nmaps);
+		if (nframes && EXIT_SUCCESS != bench_render(maps, nmaps, nframes))
+			return EXIT_FAILURE;
+		if (ngames)
+			return bench(maps, nmaps, ngames, baseline_path);
+		return EXIT_SUCCESS;
+	}
+
+	if (versus.path) {
+		if (custom_map.plant) {
+			fprintf(stderr, "%s: Only built-in maps can be played versus\n", versus.path);
+			return EXIT_FAILURE;
+		}
+		if (open_versus(&map) < 0)
+			return EXIT_FAILURE;
+		save_term();
+		prepare_term();
+		play_versus(map);
+		return EXIT_SUCCESS;
+	}
+
 	save_term();
 	prepare_term();
-	if (0 <= map)
+	if (snapshot_path) {
+		atexit(save_snapshot);
+		if (load_snapshot()) {
+			world.partially_damaged = 0;
+			paused = 1;
+			marathon();
+			wait_user();
+		}
+	}
+	if (custom_map.plant) {
+		enter_map(&custom_map);
+		wait_user();
+		enter_welcome_menu();
+	} else if (0 <= map)
 		enter_maps_menu(map, 1);
 	else
 		enter_welcome_menu();